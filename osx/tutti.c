@@ -12,6 +12,11 @@
 #include "tutorem/SN76489AN.h"
 #include "tutorem/TMS9918ANL.h"
 #include "tutorem/Debugger.h"
+#include "tutorem/Governor.h"
+#include "tutorem/Capture.h"
+#include "tutorem/Audio.h"
+#include "tutorem/Keyboard.h"
+#include "tutorem/Timing.h"
 
 char TT_ROM1[32768], TT_ROM2[16384];
 
@@ -72,17 +77,14 @@ int gCurrentBit=0;
 #define LONGPASTEWAIT 300
 
 int gCycle;
+int gRunTicks = TICKSPERFRAME;
 extern int gDecrementerEnabled;
 int runDebugEnabled;
 int frameCountDown;
-struct timeval tv;
-
-char gKeyboard[SDLK_LAST];
 
 /* Me love you, long long_time!() */
 static inline long long_time() {
-	gettimeofday(&tv, NULL);
-	return (tv.tv_sec * 1000000) + tv.tv_usec;
+	return (long)(Timing_Now() / 1000);
 }
 
 static inline void SaveSpeed() {
@@ -290,7 +292,7 @@ void resetTutor()
 	TMS9918_Init();
 #if ENABLE_AUDIO
 	SDL_PauseAudio(1);
-	SN76489AN_Init();
+	Audio_Reset();
 	SDL_PauseAudio(0);
 #endif
 	SDL_WM_SetCaption("Tutti", "Tutti");
@@ -299,7 +301,7 @@ void resetTutor()
 	// the Tutor's init routine turns IRQs off
 	// and we automatically close loads as a consequence.
         FinishTapeSave();
-	bzero(gKeyboard, SDLK_LAST);
+	Keyboard_Clear();
 	gPastewait = 0;
 	if (pastechars) {
 		free(pasteboard);
@@ -314,42 +316,170 @@ void resetTutor()
 	frameCountDown = FPSDIVISOR;
 }
 
-static void audio_callback(void *userdata, uint8_t *stream, int length)
-{
-	SN76489AN_GenerateSamples((int16_t *)stream, (size_t)length);
-}
-
 int main(int argc, char *argv[])
 {
 	TWORD instruction;
-	long ticks;
+	long ticks, presentCost;
+	int presents;
 	SDL_TimerID frameclock;
 	int factor = 1000000/FPS;
-	int runticks = TICKSPERFRAME;
+	int startInDebugger = 0;
+	int renderThreaded = 0;
+	int filter = FILTER_NONE, filterThreads = 4;
+	int governed = 0;
+	int headless = 0;
+	char *capturePath = NULL;
+	int captureEvery = 1;
+	unsigned long captureLimit = 0;
+	Uint64 cycleLimit = 0;
+	char *recordPath = NULL;
+	char *keymapPath = NULL;
+	int audioPaced = 0;
+	long spin = 0;
+	Uint64 emulatedCycles = 0;
+	int i;
 #if ENABLE_AUDIO
-	SDL_AudioSpec *desired = malloc(sizeof(SDL_AudioSpec));
+	SDL_AudioSpec *desired, obtained;
+	int audioRate = A_FREQUENCY, audioSamples = A_SAMPLES;
+#endif
 
-	desired->freq = A_FREQUENCY;
+	/* Options:
+	   -d	start in the debugger
+	   -x n	display scale, 1 to 4
+	   -p file	load palette (lines of "r g b")
+	   -k file	load keymap (lines of "row bit key", see Keyboard.c)
+	   -t	draw the display on its own thread
+	   -f name	post-process: scanlines, crt or smooth
+	   -j n	number of threads for -f
+	   -g	choose the present interval from host load
+	   -c file	capture frames: numbered .ppm or .png files, or a
+	   		.y4m stream ("-" for standard output)
+	   -n n	capture every nth frame
+	   -N n	quit after capturing n frames
+	   -w file	record sound to a WAV file, or raw samples to a .raw
+	   		file or standard output ("-")
+	   -a	pace the emulation by the sound device, not the clock
+	   -S n	spin for the last n microseconds of each wait, for
+	   	steadier timing at the cost of CPU
+	   -r n	sound output rate, e.g. 22050 or 48000,
+	   	from 8000 to 192000
+	   -b n	sound device buffer, in samples
+	   -s	soft-clip the sound, like an overdriven amplifier
+	   -T n	quit after n milliseconds of emulated time
+	   -H	no display or sound device, and don't pace to real time;
+	   	sound is made at the -r rate for -w alone */
+	for (i=1; i<argc; i++) {
+		if (!strncmp(argv[i], "-d", 2))
+			startInDebugger = 1;
+		else if (!strncmp(argv[i], "-x", 2)) {
+			if (argv[i][2])
+				TMS9918_SetScale(atoi(argv[i]+2));
+			else if (i+1 < argc)
+				TMS9918_SetScale(atoi(argv[++i]));
+		}
+		else if (!strcmp(argv[i], "-p") && i+1 < argc)
+			TMS9918_LoadPalette(argv[++i]);
+		else if (!strcmp(argv[i], "-k") && i+1 < argc)
+			keymapPath = argv[++i];
+		else if (!strcmp(argv[i], "-t"))
+			renderThreaded = 1;
+		else if (!strcmp(argv[i], "-f") && i+1 < argc) {
+			filter = TMS9918_FilterNamed(argv[++i]);
+			if (filter < 0) {
+				fprintf(stderr, "Unknown filter %s\n", argv[i]);
+				filter = FILTER_NONE;
+			}
+		}
+		else if (!strcmp(argv[i], "-j") && i+1 < argc)
+			filterThreads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-g"))
+			governed = 1;
+		else if (!strcmp(argv[i], "-c") && i+1 < argc)
+			capturePath = argv[++i];
+		else if (!strcmp(argv[i], "-n") && i+1 < argc)
+			captureEvery = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-N") && i+1 < argc)
+			captureLimit = strtoul(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "-w") && i+1 < argc)
+			recordPath = argv[++i];
+		else if (!strcmp(argv[i], "-T") && i+1 < argc)
+			cycleLimit = (Uint64)strtoul(argv[++i], NULL, 10) *
+				(CLOCKSPEED / 1000);
+		else if (!strcmp(argv[i], "-a"))
+			audioPaced = 1;
+		else if (!strcmp(argv[i], "-S") && i+1 < argc)
+			spin = atol(argv[++i]);
+#if ENABLE_AUDIO
+		else if (!strcmp(argv[i], "-r") && i+1 < argc) {
+			audioRate = atoi(argv[++i]);
+			if (audioRate < A_MIN_FREQUENCY ||
+					audioRate > A_MAX_FREQUENCY) {
+				fprintf(stderr, "Sound rate must be %d to %d\n",
+					A_MIN_FREQUENCY, A_MAX_FREQUENCY);
+				audioRate = A_FREQUENCY;
+			}
+		}
+		else if (!strcmp(argv[i], "-b") && i+1 < argc) {
+			audioSamples = atoi(argv[++i]);
+			if (audioSamples < 1 || audioSamples > A_MAX_SAMPLES) {
+				fprintf(stderr, "Sound buffer must be 1 to %d\n",
+					A_MAX_SAMPLES);
+				audioSamples = A_SAMPLES;
+			}
+		}
+		else if (!strcmp(argv[i], "-s"))
+			SN76489AN_SetSoftClip(1);
+#endif
+		else if (!strcmp(argv[i], "-H"))
+			headless = 1;
+	}
+	if (headless)
+		putenv("SDL_VIDEODRIVER=dummy");
+
+#if ENABLE_AUDIO
+	desired = malloc(sizeof(SDL_AudioSpec));
+
+	desired->freq = audioRate;
 	desired->format = AUDIO_S16SYS;
 	desired->channels = 1;
 	// This needs to be very, VERY low latency to intercept
 	// rapid changes to the DCSG registers.
-	desired->samples = 512;
-	desired->callback = audio_callback;
+	desired->samples = audioSamples;
+	desired->callback = Audio_Callback;
 	desired->userdata = NULL;
 
-	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
+	if (SDL_Init(SDL_INIT_VIDEO | ((headless) ? 0 : SDL_INIT_AUDIO)) < 0)
 	{
 		printf("Couldn`t load SDL.\n");
 		exit(-1);
 	}
 	atexit(SDL_Quit);
-	if (SDL_OpenAudio(desired, NULL) < 0)
-	{
-		printf("Couldn't open audio: %s\n", SDL_GetError());
-		exit(-1);
+	if (headless) {
+		// Nothing plays, so make samples at the rate asked for, for
+		// the recording alone.
+		obtained.freq = audioRate;
+		obtained.samples = 0;
+	} else {
+		// Take whatever rate the device wants, since we resample
+		// anyway, but let SDL convert if it won't do 16-bit mono.
+		if (SDL_OpenAudio(desired, &obtained) < 0)
+		{
+			printf("Couldn't open audio: %s\n", SDL_GetError());
+			exit(-1);
+		}
+		if (obtained.format != AUDIO_S16SYS || obtained.channels != 1) {
+			SDL_CloseAudio();
+			if (SDL_OpenAudio(desired, NULL) < 0)
+			{
+				printf("Couldn't open audio: %s\n", SDL_GetError());
+				exit(-1);
+			}
+			obtained = *desired;
+		}
 	}
 	free(desired);
+	if (Audio_Init(obtained.freq, CLOCKSPEED))
+		exit(-1);
 #else
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
 	{
@@ -361,15 +491,41 @@ int main(int argc, char *argv[])
 
 	LoadROM(pathToTutor1(), pathToTutor2());
 	resetTutor();
+	// Key names only exist once SDL has set up the keyboard.
+	if (keymapPath)
+		Keyboard_LoadMap(keymapPath);
 
-	if (argc == 2 && !strncmp(argv[1], "-d", 2))
+	if (startInDebugger)
 		gDebugger.breakpointHit = 1;
+	if (filter != FILTER_NONE)
+		TMS9918_SetFilter(filter, filterThreads);
+	if (renderThreaded)
+		TMS9918_StartRenderThread();
+	// Present at most every 1/60 second, and at least every 1/5.
+	Governor_Init(factor, FPS/60, FPS/5);
+	// Each slice is due exactly its emulated time after the last; give
+	// up on catching up after a tenth of a second.
+	Timing_Init(TICKSPERFRAME, CLOCKSPEED, spin, 100000);
+	// A capture is one frame per VDP frame, so it keeps the fixed
+	// cadence.
+	if (capturePath) {
+		if (Capture_Start(capturePath, captureEvery, captureLimit,
+				FPS, FPSDIVISOR+1))
+			exit(-1);
+		governed = 0;
+	}
+#if ENABLE_AUDIO
+	// Two device buffers in hand, or none without a device.
+	Audio_SetLatency(2 * obtained.samples);
+	if (recordPath && Audio_Record(recordPath))
+		exit(-1);
+#endif
 
 	gCycle = 0;
 	while (!gQuitWhenAble)
 	{
 		gShowFrame = long_time();
-		while (gCycle < runticks && !gQuitWhenAble && !gResetWhenAble)
+		while (gCycle < gRunTicks && !gQuitWhenAble && !gResetWhenAble)
 		{
 			if (gDebugger.breakpointHit && !gDebugger.enabled)
 				Debugger_Enable();
@@ -390,27 +546,66 @@ int main(int argc, char *argv[])
 		}
 
 		gCycle -= TICKSPERFRAME;
+		// Recordings and captures are timed by emulated cycles, not
+		// the host clock.
+		emulatedCycles += TICKSPERFRAME;
+#if ENABLE_AUDIO
+		Audio_Slice(TICKSPERFRAME);
+#endif
+		if (capturePath)
+			Capture_SetTime(emulatedCycles * 1000000 / CLOCKSPEED);
+		if (cycleLimit && emulatedCycles >= cycleLimit)
+			gQuitWhenAble = 1;
 		if (gResetWhenAble)
 			resetTutor();
 
 		PollKeyboard();
-		if (frameCountDown++ >= FPSDIVISOR+gWarpSpeed) {
+		// The governor only decides when to present. The VDP frame
+		// flag keeps the fixed cadence so the emulation doesn't
+		// depend on host load.
+		if (governed && !gWarpSpeed &&
+				Governor_Slice(long_time() - gShowFrame))
 			TMS9918_Redraw();
+		// What presents really cost, wherever they were drawn. Elided
+		// redraws don't count, and with -t the drawing happens on the
+		// render thread, not in TMS9918_Redraw.
+		presents = TMS9918_PresentCost(&presentCost);
+		if (governed && presents)
+			Governor_Presented(presentCost / presents);
+		if (frameCountDown++ >= FPSDIVISOR+gWarpSpeed) {
+			if (!governed || gWarpSpeed)
+				TMS9918_Redraw();
 			frameCountDown = 0;
 			VDP_Registers.ST &= ~VDP_ST_FLAG_F;
+			if (Capture_Done())
+				gQuitWhenAble = 1;
 		}
 		if (!gForceSync)
 		{
 			TMS9995_TriggerDecrementer();
 		}
-		if (!gWarpSpeed) {
-			// Usleep instead of using timers; it's more efficient.
-			ticks = factor - (long_time() - gShowFrame);
-			if (ticks > 0)
-				usleep((useconds_t)ticks);
+		if (!gWarpSpeed && !headless) {
+			// Wait until the slice is due by the clock.
+#if ENABLE_AUDIO
+			// Or sleep off however far the sound is ahead of the
+			// device. Never more than a slice, in case the device
+			// has stopped.
+			if (audioPaced) {
+				ticks = Audio_Ahead();
+				if (ticks > factor) ticks = factor;
+				Timing_Sleep(ticks);
+			} else
+#endif
+			Timing_Wait();
 		}
 	}
 
+	Timing_Stop();
+	TMS9918_StopRenderThread();
+	Capture_Stop();
+#if ENABLE_AUDIO
+	Audio_StopRecording();
+#endif
 	SDL_Quit();	
 
 	return 0;
@@ -482,7 +677,7 @@ void LoadSnapshot()
 	read(fd, (void *)(&VDP_Registers), sizeof(VDP_Registers));
 
 	close(fd);
-	TMS9918_Force_Redraw();
+	TMS9918_Reload();
 }
 
 void PollKeyboard()
@@ -580,7 +775,7 @@ void PollKeyboard()
 /* Mode keys */
 				// Handle specially: MOD
 				if (sym == SDLK_RCTRL || sym == SDLK_RALT || sym == SDLK_KP_ENTER)
-					gKeyboard[sym] = 1;
+					Keyboard_Set(sym, 1);
 				if (sym == SDLK_LSHIFT || sym == SDLK_RSHIFT)
 					Shift = 1;
 /* Debugger keys */
@@ -637,7 +832,7 @@ void PollKeyboard()
 				else if (!pastechars) {
 					if ((sym >= SDLK_BACKSPACE && sym <= SDLK_z) || sym == SDLK_RETURN || sym == SDLK_SPACE || (sym >= SDLK_UP && sym <= SDLK_LEFT))
 					{
-						gKeyboard[sym] = 1;
+						Keyboard_Set(sym, 1);
 					}
 /*
 					else if (sym >= SDLK_F8 && sym <= SDLK_F11)
@@ -646,15 +841,15 @@ void PollKeyboard()
 					}
 */
 					else if (sym == SDLK_RSHIFT) {
-						gKeyboard[sym] = 1;
+						Keyboard_Set(sym, 1);
 					}
 					else if (sym >= SDLK_LSHIFT && sym <= SDLK_LCTRL )
 					{
-						gKeyboard[sym] = 1;
+						Keyboard_Set(sym, 1);
 					}
 					else if (sym >= SDLK_KP0 && sym <= SDLK_KP_PERIOD)
 					{
-						gKeyboard[sym] = 1;
+						Keyboard_Set(sym, 1);
 					}
 				}
 				break;
@@ -665,7 +860,7 @@ void PollKeyboard()
 				{
 					Shift = 0;
 				}
-				gKeyboard[sym] = 0;
+				Keyboard_Set(sym, 0);
 /*
 				if (sym >= SDLK_BACKSPACE && sym <= SDLK_z || sym == SDLK_RETURN || sym == SDLK_SPACE || sym >= SDLK_UP && sym <= SDLK_LEFT)
 					gKeyboard[sym] = 0;
@@ -695,16 +890,16 @@ void PollKeyboard()
 		// slow, but always puts the alpha lock back to a known
 		// state. As a side effect, if they start out in lower case,
 		// this makes everything uppercase -- considered a feature.
-		memset(gKeyboard, 0, SDLK_LAST);
+		Keyboard_Clear();
 		gPastewait = SHORTPASTEWAIT;
 		switch(--pastechord) {
 			case 4:
 			case 0:
 				// Hit alpha lock
-				gKeyboard[SDLK_LCTRL] = 1;
+				Keyboard_Set(SDLK_LCTRL, 1);
 				return;
 			case 2:
-				gKeyboard[pastechar] = 1;
+				Keyboard_Set(pastechar, 1);
 				return;	
 			default:
 				return;
@@ -712,7 +907,7 @@ void PollKeyboard()
 	}
 	if (pastepos == pastechars) {
 		SDL_WM_SetCaption("Tutti", "Tutti");
-		memset(gKeyboard, 0, SDLK_LAST);
+		Keyboard_Clear();
 		free(pasteboard);
 		pastechars = 0;
 		RestoreSpeed();
@@ -722,15 +917,15 @@ void PollKeyboard()
 	// Emulate keyup.
 	if (gKeyboard[SDLK_LSHIFT]) {
 		if (pastechord != -1) {
-			memset(gKeyboard, 0, SDLK_LAST);
-			gKeyboard[SDLK_LSHIFT] = 1;
+			Keyboard_Clear();
+			Keyboard_Set(SDLK_LSHIFT, 1);
 			gPastewait = SHORTPASTEWAIT;
 			pastechord = -1;
 			return;
 		} else
 			pastechord = 0;
 	}
-	memset(gKeyboard, 0, SDLK_LAST);
+	Keyboard_Clear();
 	if (pastechar) {
 		// Wait an extra beat for ENTER.
 		gPastewait = (pastechar == 10 || pastechar == 13) ? LONGPASTEWAIT : SHORTPASTEWAIT;
@@ -746,8 +941,8 @@ void PollKeyboard()
 
 // Convert pasted characters to Tomy virtual keystrokes AS THEY WOULD BE
 // ENTERED (not the actual Tomy keys).
-#define KEYSET(x,z) if ((x)) { gKeyboard[z] = 1; return; }
-#define KEYSSET(x,z) if ((x)) { gKeyboard[SDLK_LSHIFT] = 1; gKeyboard[z] = 1; return; }
+#define KEYSET(x,z) if ((x)) { Keyboard_Set(z, 1); return; }
+#define KEYSSET(x,z) if ((x)) { Keyboard_Set(SDLK_LSHIFT, 1); Keyboard_Set(z, 1); return; }
 #define KEYCODE(x,z) KEYSET((pastechar == x), z)
 #define KEYSCODE(x,z) KEYSSET((pastechar == x), z)
 
@@ -0,0 +1,480 @@
+/* Audio.c
+	Sound output.
+
+   Samples are generated on the emulation thread at the end of each
+   slice, as many as the slice's emulated cycles are worth, and put on a
+   lock-free ring; the SDL callback only copies them out. Generation cost
+   lands on the emulation thread where it is predictable, rather than on
+   the device's deadline, and since the count comes from the cycle total
+   alone, what's generated (and recorded) is the same on every run and
+   every host, whatever the wall clock did. If the callback finds the
+   ring short it plays silence and counts an underrun; samples that don't
+   fit are dropped and counted as overruns.
+
+   The CPU doesn't touch the DCSG itself. Each port write is stamped
+   with the emulated sample it happened at and queued; generation, on the
+   same thread at the end of the slice, applies the writes at those
+   positions within the block, so quick register changes are heard
+   rather than coalesced.
+
+   The main loop can also pace itself by the sound device rather than
+   the host clock (Audio_Ahead): it runs slices until the ring holds the
+   target latency, then sleeps off the excess. The emulation then goes
+   exactly as fast as the device plays, so the two can't drift apart.
+
+   The chip is generated at its own rate, DCSG_CLOCK/DCSG_DIVIDER, and a
+   polyphase FIR converts that to whatever rate the device runs at, so
+   the OS mixer doesn't have to resample behind our back. Output sample
+   k is taken at exactly chip sample k*DCSG_CLOCK/(DCSG_DIVIDER*rate),
+   with no rounding carried along, so a recording of n emulated cycles
+   holds exactly n*rate/clock samples once it's stopped, however the
+   run went. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "SDL/SDL.h"
+
+#include "SN76489AN.h"
+#include "Audio.h"
+
+#if defined(__clang__) || defined(__GNUC__)
+#  define LIKELY(x)   (__builtin_expect(!!(x), 1))
+#  define UNLIKELY(x) (__builtin_expect(!!(x), 0))
+#else
+#  define LIKELY(x)   (!!(x))
+#  define UNLIKELY(x) (!!(x))
+#endif
+
+#define RING_SIZE	8192	// samples, a power of two
+#define BLOCK_SIZE	1024
+#define EVENT_QUEUE	1024	// register writes, a power of two
+
+// Resampler: TAPS chip samples per output sample, and the filter for
+// each of PHASES fractional positions between two chip samples.
+#define TAPS		32
+#define PHASE_BITS	8
+#define PHASES		(1 << PHASE_BITS)
+#define HISTORY		(BLOCK_SIZE + TAPS)
+
+// Order ring stores against the callback on the other side.
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define AUDIO_BARRIER()	__sync_synchronize()
+#elif __ppc__
+#define AUDIO_BARRIER()	__asm__ __volatile__ ("sync" ::: "memory")
+#else
+#define AUDIO_BARRIER()	__asm__ __volatile__ ("" ::: "memory")
+#endif
+
+extern int gCycle;
+
+typedef struct AudioEventStruct
+{
+	Uint32 when;	// emulated chip sample number, wrapping
+	Uint8 value;
+} AudioEvent;
+
+static int sampleRate = A_FREQUENCY;	// device rate
+static Uint32 cpuClock = 2700000;
+static int latency = 2 * A_SAMPLES;	// target ring fill
+
+/* Emulated time in chip samples: sliceChip at the start of the
+   current slice, plus sliceRemainder/(DCSG_DIVIDER * cpuClock). */
+static Uint32 sliceChip = 0;
+static Uint64 sliceRemainder = 0;
+// The next chip sample to generate.
+static Uint32 chipTime = 0;
+// Cycles accounted for, and device samples made, since Audio_Init.
+static Uint64 cycleTotal = 0, outputTotal = 0;
+
+// Chip samples not yet resampled; the next output sample starts at
+// history[resampleAt] plus resampleFraction/resampleDenominator of a
+// sample, which picks the phase. Each output sample moves on by
+// resampleStep and resampleStepFraction.
+static Sint16 fir[PHASES][TAPS];
+static int16_t history[HISTORY];
+static int historyCount = 0;
+static int resampleAt = 0, resampleStep;
+static Uint32 resampleFraction = 0, resampleStepFraction;
+static Uint32 resampleDenominator;
+
+// Port writes go in at eventHead and out at eventTail, both on the
+// emulation thread.
+static AudioEvent events[EVENT_QUEUE];
+static Uint32 eventHead = 0, eventTail = 0;
+
+// The emulation thread only moves ringWrite, and the callback only
+// moves ringRead.
+static int16_t ring[RING_SIZE];
+static volatile Uint32 ringRead = 0, ringWrite = 0;
+static volatile unsigned long underruns = 0, overruns = 0;
+
+static FILE *wav = NULL;
+static Uint32 wavSamples = 0;
+static int wavRaw = 0;	// no header, for .raw files and standard output
+
+/* Windowed-sinc (Blackman) filter bank for the resampler, passing up to
+   90% of whichever Nyquist frequency is lower. Each phase sums to unity
+   so there is no DC gain or loss. */
+static void Audio_MakeFilter()
+{
+	double chipRate = (double)DCSG_CLOCK / DCSG_DIVIDER;
+	double cutoff, h[TAPS], sum, d, x;
+	int p, k, total;
+
+	cutoff = 0.45 * ((sampleRate < chipRate) ? sampleRate / chipRate : 1.0);
+	for (p=0 ; p<PHASES ; p++) {
+		sum = 0.0;
+		for (k=0 ; k<TAPS ; k++) {
+			d = k - (TAPS/2 - 1) - (double)p / PHASES;
+			x = M_PI * 2 * cutoff * d;
+			h[k] = (x == 0.0) ? 1.0 : sin(x) / x;
+			h[k] *= 0.42 + 0.5 * cos(2 * M_PI * d / TAPS) +
+				0.08 * cos(4 * M_PI * d / TAPS);
+			sum += h[k];
+		}
+		total = 0;
+		for (k=0 ; k<TAPS ; k++) {
+			fir[p][k] = (Sint16)floor(h[k] / sum * 32768.0 + 0.5);
+			total += fir[p][k];
+		}
+		fir[p][TAPS/2 - 1] += 32768 - total;
+	}
+}
+
+/* Set the device rate and the CPU clock emulated time is counted in.
+   Returns nonzero if the rate is too low for the resampler, which has to
+   find a whole output sample's worth of chip samples in its window. */
+int Audio_Init(int rate, Uint32 clock)
+{
+	if (rate <= 0 || DCSG_CLOCK / ((Uint32)DCSG_DIVIDER * rate) >= TAPS) {
+		fprintf(stderr, "Can't make sound at %d Hz\n", rate);
+		return 1;
+	}
+	sampleRate = rate;
+	cpuClock = clock;
+	sliceChip = chipTime = 0;
+	sliceRemainder = 0;
+	cycleTotal = outputTotal = 0;
+	historyCount = 0;
+	resampleAt = 0;
+	resampleFraction = 0;
+	resampleDenominator = (Uint32)DCSG_DIVIDER * rate;
+	resampleStep = DCSG_CLOCK / resampleDenominator;
+	resampleStepFraction = DCSG_CLOCK % resampleDenominator;
+	Audio_MakeFilter();
+	return 0;
+}
+
+// Reset the chip, dropping writes not yet heard. The history is
+// silenced rather than dropped, so no time goes missing.
+void Audio_Reset()
+{
+	eventTail = eventHead;
+	SN76489AN_Init();
+	memset(history, 0, historyCount * sizeof(int16_t));
+}
+
+// Apply the oldest queued write.
+static void Audio_ApplyEvent()
+{
+	SN76489AN_WritePort(events[eventTail & (EVENT_QUEUE - 1)].value);
+	eventTail++;
+}
+
+/* Queue a write to the sound port, stamped with the current emulated
+   time. */
+void Audio_Write(Uint8 value)
+{
+	AudioEvent *event;
+
+	// A slice with this many writes in it is unlikely; if it happens,
+	// the oldest just go in early.
+	if (UNLIKELY(eventHead - eventTail == EVENT_QUEUE))
+		Audio_ApplyEvent();
+	event = &events[eventHead & (EVENT_QUEUE - 1)];
+	event->when = sliceChip + (Uint32)((sliceRemainder +
+		(Uint64)gCycle * DCSG_CLOCK) / ((Uint64)DCSG_DIVIDER * cpuClock));
+	event->value = value;
+	eventHead++;
+}
+
+/* Generate count chip samples starting at chip sample start, applying
+   each queued write at its own sample. Writes that are already late go
+   in at the start. */
+static void Audio_Render(int16_t *out, int count, Uint32 start)
+{
+	int done = 0, n;
+	Sint32 at;
+
+	while (done < count) {
+		n = count - done;
+		while (eventTail != eventHead) {
+			at = (Sint32)(events[eventTail & (EVENT_QUEUE - 1)].when - start);
+			if (at > done) {
+				if (at < count)
+					n = at - done;
+				break;
+			}
+			Audio_ApplyEvent();
+		}
+		SN76489AN_GenerateSamples(out + done, n * sizeof(int16_t));
+		done += n;
+	}
+}
+
+// Generate the next count chip samples (at most BLOCK_SIZE) into the
+// history, dropping what the resampler has finished with.
+static void Audio_Generate(int count)
+{
+	int done = resampleAt;
+
+	if (done) {
+		memmove(history, history + done,
+			(historyCount - done) * sizeof(int16_t));
+		historyCount -= done;
+		resampleAt = 0;
+	}
+	Audio_Render(history + historyCount, count, chipTime);
+	SN76489AN_OutputStage(history + historyCount, count);
+	chipTime += count;
+	historyCount += count;
+}
+
+// Make up to max device samples from the history; returns how many.
+static int Audio_Resample(int16_t *out, int max)
+{
+	int n = 0, k;
+	Sint32 sum;
+	int16_t *in;
+	Sint16 *taps;
+
+	while (n < max && resampleAt + TAPS <= historyCount) {
+		in = history + resampleAt;
+		taps = fir[((Uint64)resampleFraction << PHASE_BITS) /
+			resampleDenominator];
+		sum = 0;
+		for (k=0 ; k<TAPS ; k++)
+			sum += in[k] * taps[k];
+		sum = (sum + (1 << 14)) >> 15;
+		out[n++] = (sum > 32767) ? 32767 : (sum < -32768) ? -32768 : sum;
+		resampleAt += resampleStep;
+		resampleFraction += resampleStepFraction;
+		if (resampleFraction >= resampleDenominator) {
+			resampleFraction -= resampleDenominator;
+			resampleAt++;
+		}
+	}
+	outputTotal += n;
+	return n;
+}
+
+static void Audio_Put16(Uint8 *p, Uint32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void Audio_Put32(Uint8 *p, Uint32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void Audio_WriteWAVHeader()
+{
+	Uint8 header[44];
+
+	memcpy(header, "RIFF", 4);
+	Audio_Put32(header + 4, 36 + wavSamples * 2);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	Audio_Put32(header + 16, 16);
+	Audio_Put16(header + 20, 1);	// PCM
+	Audio_Put16(header + 22, 1);	// mono
+	Audio_Put32(header + 24, sampleRate);
+	Audio_Put32(header + 28, sampleRate * 2);
+	Audio_Put16(header + 32, 2);
+	Audio_Put16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	Audio_Put32(header + 40, wavSamples * 2);
+	fwrite(header, 1, 44, wav);
+}
+
+/* Aim to keep target samples queued for the device. Twice that is
+   the most that will be queued before samples are dropped. Zero means
+   there is no device, and nothing is queued. */
+void Audio_SetLatency(int target)
+{
+	latency = target;
+}
+
+void Audio_GetStats(AudioStats *stats)
+{
+	stats->buffered = ringWrite - ringRead;
+	stats->underruns = underruns;
+	stats->overruns = overruns;
+}
+
+/* How far the ring is past its target fill, in microseconds; negative
+   if the emulation is behind the device. */
+long Audio_Ahead()
+{
+	Sint32 queued = ringWrite - ringRead;	// a snapshot is good enough
+
+	return (long)(((Sint64)queued - latency) * 1000000 / sampleRate);
+}
+
+/* Record everything the DCSG generates from now on to a 16-bit mono
+   WAV file, or with no header if the name ends in .raw or is "-" for
+   standard output. Returns nonzero on failure. */
+int Audio_Record(char *path)
+{
+	int len = strlen(path);
+
+	wavRaw = (!strcmp(path, "-") ||
+		(len > 4 && !strcmp(path + len - 4, ".raw")));
+	if (strcmp(path, "-"))
+		wav = fopen(path, "wb");
+	else {
+		wav = stdout;
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	}
+	if (!wav) {
+		fprintf(stderr, "Couldn't open %s\n", path);
+		return 1;
+	}
+	wavSamples = 0;
+	if (!wavRaw)
+		Audio_WriteWAVHeader();
+	return 0;
+}
+
+static void Audio_WriteRecording(int16_t *block, int n)
+{
+	Uint8 bytes[BLOCK_SIZE * 2];
+	int i;
+
+	// WAV is little-endian whatever the host is, and so is raw.
+	for (i=0 ; i<n ; i++)
+		Audio_Put16(bytes + i*2, (Uint16)block[i]);
+	fwrite(bytes, 2, n, wav);
+	wavSamples += n;
+}
+
+/* Finish the recording and close the file. The last few samples need
+   chip samples past the end of emulated time, which are run on from
+   where the chip stands, so the recording covers exactly the cycles
+   emulated. */
+void Audio_StopRecording()
+{
+	int16_t block[BLOCK_SIZE];
+	Uint64 target = cycleTotal * sampleRate / cpuClock;
+	int n;
+
+	if (!wav) return;
+	while (outputTotal < target) {
+		n = (target - outputTotal > BLOCK_SIZE) ?
+			BLOCK_SIZE : (int)(target - outputTotal);
+		n = Audio_Resample(block, n);
+		if (n)
+			Audio_WriteRecording(block, n);
+		else
+			Audio_Generate(TAPS);
+	}
+	if (wavRaw)
+		fflush(wav);
+	else {
+		fseek(wav, 0, SEEK_SET);
+		Audio_WriteWAVHeader();
+	}
+	if (wav != stdout)
+		fclose(wav);
+	wav = NULL;
+	fprintf(stderr, "Recorded %lu samples\n", (unsigned long)wavSamples);
+}
+
+// Queue samples for the device, dropping what doesn't fit.
+static void Audio_Queue(int16_t *block, int n)
+{
+	Uint32 limit = (2 * latency < RING_SIZE) ? 2 * latency : RING_SIZE;
+	Uint32 queued = ringWrite - ringRead, space, at;
+	int first;
+
+	if (!latency) return;	// no device
+	space = (queued < limit) ? limit - queued : 0;
+	if ((Uint32)n > space) {
+		overruns += n - space;
+		n = space;
+	}
+	at = ringWrite & (RING_SIZE - 1);
+	first = (at + n > RING_SIZE) ? RING_SIZE - at : n;
+	memcpy(ring + at, block, first * sizeof(int16_t));
+	memcpy(ring, block + first, (n - first) * sizeof(int16_t));
+	AUDIO_BARRIER();
+	ringWrite += n;
+}
+
+// Account for a slice of emulated time and generate its samples.
+void Audio_Slice(Uint32 cycles)
+{
+	int16_t block[BLOCK_SIZE];
+	Uint64 denominator = (Uint64)DCSG_DIVIDER * cpuClock;
+	int n;
+
+	cycleTotal += cycles;
+	sliceRemainder += (Uint64)cycles * DCSG_CLOCK;
+	sliceChip += (Uint32)(sliceRemainder / denominator);
+	sliceRemainder %= denominator;
+
+	// With no device and no recording (-H alone) nobody hears it, so
+	// just keep the chip's registers up to date.
+	if (!wav && !latency) {
+		while (eventTail != eventHead)
+			Audio_ApplyEvent();
+		chipTime = sliceChip;
+		return;
+	}
+
+	while ((Sint32)(sliceChip - chipTime) > 0) {
+		n = sliceChip - chipTime;
+		Audio_Generate((n > BLOCK_SIZE) ? BLOCK_SIZE : n);
+		while ((n = Audio_Resample(block, BLOCK_SIZE)) > 0) {
+			if (wav)
+				Audio_WriteRecording(block, n);
+			// If the device can't keep up (warp speed, say),
+			// samples are dropped from playback only.
+			Audio_Queue(block, n);
+		}
+	}
+}
+
+void Audio_Callback(void *userdata, Uint8 *stream, int length)
+{
+	int16_t *out = (int16_t *)stream;
+	int count = length / sizeof(int16_t), n, first;
+	Uint32 at;
+
+	n = ringWrite - ringRead;
+	AUDIO_BARRIER();
+	if (n < count) {
+		underruns++;
+		memset(out + n, 0, (count - n) * sizeof(int16_t));
+	} else
+		n = count;
+	at = ringRead & (RING_SIZE - 1);
+	first = (at + n > RING_SIZE) ? RING_SIZE - at : n;
+	memcpy(out, ring + at, first * sizeof(int16_t));
+	memcpy(out + first, ring, (n - first) * sizeof(int16_t));
+	AUDIO_BARRIER();
+	ringRead += n;
+}
@@ -0,0 +1,21 @@
+/* Audio.h
+	Sound output: drives the DCSG from emulated time, feeds the SDL
+	callback, and records to WAV. */
+
+typedef struct AudioStatsStruct
+{
+	int buffered;			// samples queued for the device
+	unsigned long underruns;	// callbacks that ran short
+	unsigned long overruns;		// samples dropped for want of room
+} AudioStats;
+
+int Audio_Init(int rate, Uint32 clock);
+void Audio_Reset();
+void Audio_Write(Uint8 value);
+void Audio_SetLatency(int target);
+void Audio_GetStats(AudioStats *stats);
+long Audio_Ahead();
+int Audio_Record(char *path);
+void Audio_StopRecording();
+void Audio_Slice(Uint32 cycles);
+void Audio_Callback(void *userdata, Uint8 *stream, int length);
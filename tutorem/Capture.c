@@ -0,0 +1,442 @@
+/* Capture.c
+	Frame capture to numbered PPM/PNG files or a Y4M stream.
+
+   Frames are taken from the palette-index backing buffer at 256x192, with
+   the palette in effect when they were drawn. The caller's thread only
+   copies the frame into a short queue; a capture thread does the
+   encoding and file I/O. If the queue fills, the caller waits, so no
+   frame is ever dropped from a capture.
+
+   Each frame is stamped with the emulated time it was presented at,
+   and the stamps are written alongside in Matroska "timecode format v2"
+   (a millisecond time per line), so a capture can be lined up exactly
+   with an audio recording however fast the emulator actually ran. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "SDL/SDL.h"
+#include "SDL/SDL_thread.h"
+
+#include "Capture.h"
+
+#define CAPTURE_QUEUE	8
+
+#define FORMAT_PPM	0
+#define FORMAT_PNG	1
+#define FORMAT_Y4M	2
+
+typedef struct CaptureFrameStruct
+{
+	Uint8 pixels[49152];
+	Uint8 palette[16][3];
+	unsigned long number;
+	Uint64 micros;
+} CaptureFrame;
+
+static CaptureFrame queue[CAPTURE_QUEUE], last;
+static int queueHead = 0, queueTail = 0, queued = 0, haveLast = 0;
+static SDL_mutex *captureLock = NULL;
+static SDL_cond *captureNotEmpty = NULL, *captureNotFull = NULL;
+static SDL_Thread *captureThread = NULL;
+static int captureStopping = 0;
+
+static int format;
+static char pattern[1024];
+static FILE *stream = NULL, *times = NULL;
+static Uint64 now = 0;	// main thread only
+static int every = 1;
+static unsigned long offered = 0, captured = 0, limit = 0;
+static Uint32 crcTable[256];
+
+static void Capture_MakeCRCTable()
+{
+	Uint32 c;
+	int n, k;
+
+	for (n=0 ; n<256 ; n++) {
+		c = n;
+		for (k=0 ; k<8 ; k++)
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crcTable[n] = c;
+	}
+}
+
+static Uint32 Capture_CRC(Uint32 crc, Uint8 *data, int length)
+{
+	crc ^= 0xFFFFFFFF;
+	while (length--)
+		crc = crcTable[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+static Uint8 *Capture_Put32(Uint8 *p, Uint32 v)
+{
+	*p++ = v >> 24;
+	*p++ = v >> 16;
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+// Write one PNG chunk; data is the chunk type followed by its contents.
+static void Capture_WriteChunk(FILE *f, Uint8 *data, int length)
+{
+	Uint8 word[4];
+
+	Capture_Put32(word, length - 4);
+	fwrite(word, 1, 4, f);
+	fwrite(data, 1, length, f);
+	Capture_Put32(word, Capture_CRC(0, data, length));
+	fwrite(word, 1, 4, f);
+}
+
+/* An indexed-colour PNG. The image data is small enough for one stored
+   (uncompressed) deflate block, so no compressor is needed. */
+static void Capture_WritePNG(FILE *f, CaptureFrame *frame)
+{
+	static Uint8 idat[4 + 2 + 5 + 192*257 + 4];
+	Uint8 header[4 + 13], plte[4 + 48], *p;
+	Uint32 a = 1, b = 0;
+	int y, x, length = 192*257;
+
+	fwrite("\211PNG\r\n\032\n", 1, 8, f);
+
+	memcpy(header, "IHDR", 4);
+	p = Capture_Put32(header + 4, 256);
+	p = Capture_Put32(p, 192);
+	*p++ = 8;	// bit depth
+	*p++ = 3;	// indexed colour
+	*p++ = 0;
+	*p++ = 0;
+	*p++ = 0;
+	Capture_WriteChunk(f, header, sizeof(header));
+
+	memcpy(plte, "PLTE", 4);
+	memcpy(plte + 4, frame->palette, 48);
+	Capture_WriteChunk(f, plte, sizeof(plte));
+
+	p = idat;
+	memcpy(p, "IDAT", 4);
+	p += 4;
+	*p++ = 0x78;	// zlib, 32K window
+	*p++ = 0x01;
+	*p++ = 0x01;	// final stored block
+	*p++ = length & 0xFF;
+	*p++ = length >> 8;
+	*p++ = ~length & 0xFF;
+	*p++ = (~length >> 8) & 0xFF;
+	for (y=0 ; y<192 ; y++) {
+		*p++ = 0;	// no filter
+		memcpy(p, frame->pixels + (y << 8), 256);
+		p += 256;
+	}
+	// Adler-32 of the uncompressed data.
+	for (x=0 ; x<length ; x++) {
+		a = (a + idat[11 + x]) % 65521;
+		b = (b + a) % 65521;
+	}
+	p = Capture_Put32(p, (b << 16) | a);
+	Capture_WriteChunk(f, idat, p - idat);
+
+	Capture_WriteChunk(f, (Uint8 *)"IEND", 4);
+}
+
+static void Capture_WritePPM(FILE *f, CaptureFrame *frame)
+{
+	Uint8 row[768], *src = frame->pixels, *dst;
+	int y, x;
+
+	fprintf(f, "P6\n256 192\n255\n");
+	for (y=0 ; y<192 ; y++) {
+		dst = row;
+		for (x=0 ; x<256 ; x++) {
+			memcpy(dst, frame->palette[*src++], 3);
+			dst += 3;
+		}
+		fwrite(row, 1, 768, f);
+	}
+}
+
+/* 4:2:0 frame, full range BT.601 ("C420jpeg"); each chroma sample is the
+   average of its 2x2 block. */
+static void Capture_WriteY4M(FILE *f, CaptureFrame *frame)
+{
+	static Uint8 plane[49152];
+	int Y[16], U[16], V[16], r, g, b, i, x, y;
+	Uint8 *src;
+
+	for (i=0 ; i<16 ; i++) {
+		r = frame->palette[i][0];
+		g = frame->palette[i][1];
+		b = frame->palette[i][2];
+		Y[i] = (77*r + 150*g + 29*b + 128) >> 8;
+		U[i] = (-43*r - 85*g + 128*b + 32768 + 128) >> 8;
+		V[i] = (128*r - 107*g - 21*b + 32768 + 128) >> 8;
+	}
+
+	fprintf(f, "FRAME\n");
+	for (i=0 ; i<49152 ; i++)
+		plane[i] = Y[frame->pixels[i]];
+	fwrite(plane, 1, 49152, f);
+#define CHROMA(table) \
+	for (y=0 ; y<96 ; y++) \
+		for (x=0 ; x<128 ; x++) { \
+			src = frame->pixels + (y << 9) + (x << 1); \
+			plane[(y << 7) + x] = (table[src[0]] + table[src[1]] + \
+				table[src[256]] + table[src[257]] + 2) >> 2; \
+		} \
+	fwrite(plane, 1, 128*96, f);
+	CHROMA(U)
+	CHROMA(V)
+#undef CHROMA
+}
+
+static void Capture_Write(CaptureFrame *frame)
+{
+	char filename[1100];
+	FILE *f;
+
+	if (times)
+		fprintf(times, "%lu.%03lu\n",
+			(unsigned long)(frame->micros / 1000),
+			(unsigned long)(frame->micros % 1000));
+	if (format == FORMAT_Y4M) {
+		Capture_WriteY4M(stream, frame);
+		return;
+	}
+	sprintf(filename, pattern, (int)frame->number);
+	f = fopen(filename, "wb");
+	if (!f) {
+		fprintf(stderr, "Couldn't write %s\n", filename);
+		return;
+	}
+	if (format == FORMAT_PNG)
+		Capture_WritePNG(f, frame);
+	else
+		Capture_WritePPM(f, frame);
+	fclose(f);
+}
+
+static int Capture_Thread(void *unused)
+{
+	SDL_LockMutex(captureLock);
+	for(;;) {
+		while (!queued && !captureStopping)
+			SDL_CondWait(captureNotEmpty, captureLock);
+		if (!queued) break;
+		// The slot stays ours until queued is decremented.
+		SDL_UnlockMutex(captureLock);
+		Capture_Write(&queue[queueTail]);
+		SDL_LockMutex(captureLock);
+		queueTail = (queueTail + 1) % CAPTURE_QUEUE;
+		queued--;
+		SDL_CondSignal(captureNotFull);
+	}
+	SDL_UnlockMutex(captureLock);
+	return 0;
+}
+
+// Close the files and free the thread primitives.
+static void Capture_Close()
+{
+	if (stream) {
+		fflush(stream);
+		if (stream != stdout) fclose(stream);
+		stream = NULL;
+	}
+	if (times) {
+		fclose(times);
+		times = NULL;
+	}
+	if (captureNotFull) SDL_DestroyCond(captureNotFull);
+	if (captureNotEmpty) SDL_DestroyCond(captureNotEmpty);
+	if (captureLock) SDL_DestroyMutex(captureLock);
+	captureNotFull = captureNotEmpty = NULL;
+	captureLock = NULL;
+}
+
+/* A file name pattern must have exactly one number in it, as %d with an
+   optional width, and nothing else for printf to take as a conversion
+   (other than %% for a %). */
+static int Capture_GoodPattern(char *p)
+{
+	int numbers = 0, width;
+
+	for ( ; *p ; p++) {
+		if (*p != '%') continue;
+		if (*++p == '%') continue;
+		for (width=0 ; *p >= '0' && *p <= '9' ; p++)
+			if (++width > 2) return 0;
+		if (*p != 'd' || numbers++) return 0;
+	}
+	return numbers == 1;
+}
+
+/* Start capturing to path. A name ending in .y4m, or "-" for standard
+   output, is one Y4M stream at rateNumerator/rateDenominator frames per
+   second; otherwise path names numbered PPM files, or PNG files if it
+   ends in .png, with a printf-style %d for the number (one is added if
+   missing). Only every'th frame is kept, and capture stops after limit
+   frames if that isn't zero. Time stamps go to path.times, except for
+   standard output. Returns nonzero on failure. */
+int Capture_Start(char *path, int every_, unsigned long limit_,
+	int rateNumerator, int rateDenominator)
+{
+	char *dot, *name, filename[1100];
+	int len = strlen(path);
+
+	if (captureThread || len > 1000) return 1;
+	if (strcmp(path, "-") && !(len > 4 && !strcmp(path + len - 4, ".y4m"))
+			&& strchr(path, '%') && !Capture_GoodPattern(path)) {
+		fprintf(stderr, "Capture name %s needs just one %%d\n", path);
+		return 1;
+	}
+	every = (every_ < 1) ? 1 : every_;
+	limit = limit_;
+	offered = captured = 0;
+	haveLast = 0;
+
+	if (!strcmp(path, "-") || (len > 4 && !strcmp(path + len - 4, ".y4m"))) {
+		format = FORMAT_Y4M;
+		if (strcmp(path, "-"))
+			stream = fopen(path, "wb");
+		else {
+			stream = stdout;
+#ifdef _WIN32
+			_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		}
+		if (!stream) {
+			fprintf(stderr, "Couldn't open %s\n", path);
+			return 1;
+		}
+		setvbuf(stream, NULL, _IOFBF, 1 << 20);
+		fprintf(stream, "YUV4MPEG2 W256 H192 F%d:%d Ip A1:1 C420jpeg\n",
+			rateNumerator, rateDenominator * every);
+	} else {
+		format = (len > 4 && !strcmp(path + len - 4, ".png")) ?
+			FORMAT_PNG : FORMAT_PPM;
+		if (strchr(path, '%'))
+			strcpy(pattern, path);
+		else {
+			// The number goes before the extension of the file
+			// name, not of a directory on the way to it.
+			name = strrchr(path, '/');
+#ifdef _WIN32
+			dot = strrchr(path, '\\');
+			if (dot && (!name || dot > name))
+				name = dot;
+#endif
+			dot = strrchr(name ? name : path, '.');
+			if (!dot) dot = path + len;
+			memcpy(pattern, path, dot - path);
+			sprintf(pattern + (dot - path), "%%06d%s", dot);
+		}
+	}
+
+	if (strcmp(path, "-")) {
+		sprintf(filename, "%s.times", path);
+		times = fopen(filename, "w");
+		if (times)
+			fprintf(times, "# timecode format v2\n");
+	}
+
+	Capture_MakeCRCTable();
+	captureLock = SDL_CreateMutex();
+	captureNotEmpty = SDL_CreateCond();
+	captureNotFull = SDL_CreateCond();
+	captureStopping = 0;
+	if (captureLock && captureNotEmpty && captureNotFull)
+		captureThread = SDL_CreateThread(Capture_Thread, NULL);
+	if (!captureThread) {
+		fprintf(stderr, "Couldn't start capture thread: %s\n",
+			SDL_GetError());
+		Capture_Close();
+		return 1;
+	}
+	return 0;
+}
+
+// Finish writing whatever is queued and close the stream.
+void Capture_Stop()
+{
+	if (!captureThread) return;
+	SDL_LockMutex(captureLock);
+	captureStopping = 1;
+	SDL_CondSignal(captureNotEmpty);
+	SDL_UnlockMutex(captureLock);
+	SDL_WaitThread(captureThread, NULL);
+	captureThread = NULL;
+	Capture_Close();
+	fprintf(stderr, "Captured %lu frames\n", captured);
+}
+
+/* Emulated microseconds since start, for stamping frames. Frames may be
+   handed over on the render thread well after the time they were drawn
+   at, so whoever takes the frame reads this and carries it along. */
+void Capture_SetTime(Uint64 micros)
+{
+	now = micros;
+}
+
+Uint64 Capture_Time()
+{
+	return now;
+}
+
+int Capture_Active()
+{
+	return captureThread != NULL;
+}
+
+// Non-zero once the frame limit has been captured.
+int Capture_Done()
+{
+	return limit && captured >= limit;
+}
+
+static void Capture_Offer(Uint8 *pixels, Uint8 palette[16][3],
+	Uint64 micros)
+{
+	if ((offered++ % every) || Capture_Done()) return;
+
+	SDL_LockMutex(captureLock);
+	while (queued == CAPTURE_QUEUE)
+		SDL_CondWait(captureNotFull, captureLock);
+	SDL_UnlockMutex(captureLock);
+
+	// Nothing else touches the head slot while it isn't queued.
+	memcpy(queue[queueHead].pixels, pixels, 49152);
+	memcpy(queue[queueHead].palette, palette, 48);
+	queue[queueHead].number = captured++;
+	queue[queueHead].micros = micros;
+
+	SDL_LockMutex(captureLock);
+	queueHead = (queueHead + 1) % CAPTURE_QUEUE;
+	queued++;
+	SDL_CondSignal(captureNotEmpty);
+	SDL_UnlockMutex(captureLock);
+}
+
+// A new frame was presented, drawn at emulated time micros.
+void Capture_Frame(Uint8 *pixels, Uint8 palette[16][3], Uint64 micros)
+{
+	if (!captureThread) return;
+	memcpy(last.pixels, pixels, 49152);
+	memcpy(last.palette, palette, 48);
+	haveLast = 1;
+	Capture_Offer(pixels, palette, micros);
+}
+
+// A frame time passed with the picture unchanged.
+void Capture_Repeat(Uint64 micros)
+{
+	if (!captureThread || !haveLast) return;
+	Capture_Offer(last.pixels, last.palette, micros);
+}
@@ -0,0 +1,12 @@
+/* Capture.h
+	Frame capture to numbered PPM/PNG files or a Y4M stream. */
+
+int Capture_Start(char *path, int every, unsigned long limit,
+	int rateNumerator, int rateDenominator);
+void Capture_Stop();
+void Capture_SetTime(Uint64 micros);
+Uint64 Capture_Time();
+int Capture_Active();
+int Capture_Done();
+void Capture_Frame(Uint8 *pixels, Uint8 palette[16][3], Uint64 micros);
+void Capture_Repeat(Uint64 micros);
@@ -11,6 +11,9 @@
 #include "TMS9918ANL.h"
 #include "Debugger.h"
 #include "Disassemble.h"
+#include "Governor.h"
+#include "Audio.h"
+#include "Timing.h"
 
 TMS9918Screen gDebugScreen, gTIScreen;
 DebuggerType gDebugger;
@@ -110,6 +113,19 @@ void Debugger_SwitchToVGP()
 	Debugger_printf(0, 9, "R5");
 	Debugger_printf(0, 10, "R6");
 	Debugger_printf(0, 11, "R7");
+	Debugger_printf(0, 13, "TILE HIT");
+	Debugger_printf(0, 14, "ELIDED");
+	Debugger_printf(0, 16, "PRESENT EVERY");
+	Debugger_printf(0, 17, "SLICE US");
+	Debugger_printf(0, 18, "PRESENT US");
+	Debugger_printf(0, 19, "LATE SLICES");
+	Debugger_printf(0, 20, "AUDIO QUEUED");
+	Debugger_printf(0, 21, "UNDERRUNS");
+	Debugger_printf(0, 22, "OVERRUNS");
+	Debugger_printf(24, 16, "JITTER US");
+	Debugger_printf(24, 17, "WORST US");
+	Debugger_printf(24, 18, "BEHIND");
+	Debugger_printf(24, 19, "SKIPPED");
 
 	Debugger_printf(24,0, "MEMORY:");
 
@@ -187,6 +203,9 @@ CPU_Registers.ST);
 void Debugger_UpdateTMS9918()
 {
 	int x, y;
+	GovernorStats stats;
+	AudioStats audio;
+	TimingStats timing;
 	
 	Debugger_printf(4, 1, "%04X", VDP_Registers.MP);
 	Debugger_printf(4, 2, "%04X", VDP_Registers.ST);
@@ -199,6 +218,30 @@ void Debugger_UpdateTMS9918()
 		Debugger_UpdateCharacters(4, y, 8);
 	}
 
+	Debugger_printf(9, 13, "%3d", TMS9918_TileCacheHitRate());
+	Debugger_UpdateCharacters(9, 13, 12);
+	Debugger_printf(9, 14, "%8lu", TMS9918_ElidedFrames() % 100000000);
+	Debugger_UpdateCharacters(9, 14, 17);
+
+	Governor_GetStats(&stats);
+	Debugger_printf(14, 16, "%3d", stats.interval);
+	Debugger_printf(14, 17, "%6d", stats.sliceCost % 1000000);
+	Debugger_printf(14, 18, "%6d", stats.presentCost % 1000000);
+	Debugger_printf(14, 19, "%8lu", stats.lateSlices % 100000000);
+	Audio_GetStats(&audio);
+	Debugger_printf(14, 20, "%6d", audio.buffered % 1000000);
+	Debugger_printf(14, 21, "%8lu", audio.underruns % 100000000);
+	Debugger_printf(14, 22, "%8lu", audio.overruns % 100000000);
+	for (y=16 ; y<23 ; y++)
+		Debugger_UpdateCharacters(14, y, 22);
+	Timing_GetStats(&timing);
+	Debugger_printf(33, 16, "%6d", timing.jitter % 1000000);
+	Debugger_printf(33, 17, "%6d", timing.worst % 1000000);
+	Debugger_printf(33, 18, "%6lu", timing.behind % 1000000);
+	Debugger_printf(33, 19, "%6lu", timing.skipped % 1000000);
+	for (y=16 ; y<20 ; y++)
+		Debugger_UpdateCharacters(33, y, 39);
+
 	for (y=0 ; y<16 ; y++)
 	{
 		Debugger_printf(18,y, "%04X", gDebugger.memoryTop+y*8);
@@ -0,0 +1,75 @@
+/* Governor.c
+	Adaptive present interval.
+
+   The main loop runs the CPU in short slices, each with a fixed host time
+   budget, and presents a frame every so many slices. The governor watches
+   what slices and presents actually cost on this host and picks that
+   interval: first so the emulation stays real time, then so as many
+   frames as possible are shown. The interval goes up as soon as presents
+   get too expensive, and comes back down one slice at a time. */
+
+#include "Governor.h"
+
+static int budget = 1666;
+static int minInterval = 10, maxInterval = 120;
+static int interval = 10, countdown = 0;
+// Running averages in 1/16 microseconds.
+static long sliceAverage = 0, presentAverage = 0;
+static unsigned long lateSlices = 0, presented = 0;
+
+void Governor_Init(int sliceMicros, int minimum, int maximum)
+{
+	budget = sliceMicros;
+	minInterval = minimum;
+	maxInterval = maximum;
+	interval = minimum;
+	countdown = 0;
+	sliceAverage = presentAverage = 0;
+	lateSlices = presented = 0;
+}
+
+/* Account for one slice of emulation and return non-zero if a frame
+   should be presented after it. */
+int Governor_Slice(long micros)
+{
+	sliceAverage += micros - (sliceAverage >> 4);
+	if (micros > budget)
+		lateSlices++;
+	if (++countdown < interval)
+		return 0;
+	countdown = 0;
+	return 1;
+}
+
+// Account for a present and choose the next interval.
+void Governor_Presented(long micros)
+{
+	long spare, want;
+
+	presentAverage += micros - (presentAverage >> 4);
+	presented++;
+
+	// What each slice leaves over, keeping an eighth in reserve, has to
+	// pay for the present spread across the interval.
+	spare = budget - (budget >> 3) - (sliceAverage >> 4);
+	if (spare <= 0)
+		want = maxInterval;
+	else
+		want = ((presentAverage >> 4) + spare - 1) / spare;
+	if (want < minInterval) want = minInterval;
+	if (want > maxInterval) want = maxInterval;
+
+	if (want > interval)
+		interval = want;
+	else if (want < interval)
+		interval--;
+}
+
+void Governor_GetStats(GovernorStats *stats)
+{
+	stats->interval = interval;
+	stats->sliceCost = sliceAverage >> 4;
+	stats->presentCost = presentAverage >> 4;
+	stats->lateSlices = lateSlices;
+	stats->presented = presented;
+}
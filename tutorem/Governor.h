@@ -0,0 +1,16 @@
+/* Governor.h
+	Adaptive present interval. */
+
+typedef struct GovernorStatsStruct
+{
+	int interval;		// slices between presented frames
+	int sliceCost;		// average host time per slice, microseconds
+	int presentCost;	// average host time per present, microseconds
+	unsigned long lateSlices;	// slices that ran over budget
+	unsigned long presented;	// frames presented
+} GovernorStats;
+
+void Governor_Init(int sliceMicros, int minInterval, int maxInterval);
+int Governor_Slice(long micros);
+void Governor_Presented(long micros);
+void Governor_GetStats(GovernorStats *stats);
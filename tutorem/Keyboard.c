@@ -0,0 +1,197 @@
+/* Keyboard.c
+	Host keys to the Tutor's key matrix.
+
+   The Tutor reads its keyboard as eight rows of eight keys, one row per
+   CRU address from EC00 to EC70, and the OS scans all of them all the
+   time. Rather than work each row out from the host keys on every read,
+   we keep the whole matrix as eight bytes and only change it when a host
+   key goes up or down (or the paster presses one), so a read is just an
+   index. Which host key is which Tutor key comes from a table, which can
+   be replaced from a file. */
+
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "SDL/SDL.h"
+
+#include "Keyboard.h"
+
+#define KEYMAP_SIZE	256
+#define KEY_PLACES	4	// most Tutor keys one host key can press
+
+typedef struct KeyMapStruct
+{
+	int sym;	// SDLK_*
+	Uint8 row;	// 0-7, for EC00-EC70
+	Uint8 bit;	// 0-7
+} KeyMap;
+
+char gKeyboard[SDLK_LAST];
+Uint8 gKeyMatrix[8];
+
+static KeyMap keymap[KEYMAP_SIZE] = {
+	{ SDLK_1, 0, 0 }, { SDLK_2, 0, 1 }, { SDLK_q, 0, 2 }, { SDLK_w, 0, 3 },
+	{ SDLK_a, 0, 4 }, { SDLK_s, 0, 5 }, { SDLK_z, 0, 6 }, { SDLK_x, 0, 7 },
+
+	{ SDLK_3, 1, 0 }, { SDLK_4, 1, 1 }, { SDLK_e, 1, 2 }, { SDLK_r, 1, 3 },
+	{ SDLK_d, 1, 4 }, { SDLK_f, 1, 5 }, { SDLK_c, 1, 6 }, { SDLK_v, 1, 7 },
+
+	{ SDLK_5, 2, 0 }, { SDLK_6, 2, 1 }, { SDLK_t, 2, 2 }, { SDLK_y, 2, 3 },
+	{ SDLK_g, 2, 4 }, { SDLK_h, 2, 5 }, { SDLK_b, 2, 6 }, { SDLK_n, 2, 7 },
+
+	{ SDLK_7, 3, 0 }, { SDLK_8, 3, 1 }, { SDLK_9, 3, 2 }, { SDLK_u, 3, 3 },
+	{ SDLK_i, 3, 4 }, { SDLK_j, 3, 5 }, { SDLK_k, 3, 6 }, { SDLK_m, 3, 7 },
+
+	// Joystick/controller 1 also detected here.
+	{ SDLK_0, 4, 0 }, { SDLK_MINUS, 4, 1 },
+	{ SDLK_o, 4, 2 }, { SDLK_KP0, 4, 2 },		// SL
+	{ SDLK_p, 4, 3 }, { SDLK_KP_PERIOD, 4, 3 },	// SR
+	{ SDLK_l, 4, 4 }, { SDLK_KP5, 4, 4 },		// down
+	{ SDLK_SEMICOLON, 4, 5 }, { SDLK_KP4, 4, 5 },	// left
+	{ SDLK_COMMA, 4, 6 }, { SDLK_KP8, 4, 6 },	// up
+	{ SDLK_PERIOD, 4, 7 }, { SDLK_KP6, 4, 7 },	// right
+
+	// Controller 2 also detected here.
+	// 0x01, 0x02 apparently unused
+	{ SDLK_EQUALS, 5, 2 }, { SDLK_KP0, 5, 2 },	// handaku // SL
+	{ SDLK_BACKQUOTE, 5, 3 }, { SDLK_KP_PERIOD, 5, 3 },	// _ // SR
+	{ SDLK_QUOTE, 5, 4 }, { SDLK_KP5, 5, 4 },	// : // down
+	{ SDLK_LEFTBRACKET, 5, 5 }, { SDLK_KP4, 5, 5 },	// left
+	{ SDLK_SLASH, 5, 6 }, { SDLK_KP8, 5, 6 },	// up
+	{ SDLK_RIGHTBRACKET, 5, 7 }, { SDLK_KP6, 5, 7 },	// right
+
+	// 0x01 apparently unused
+	{ CAPS_LOCK_KEY, 6, 1 },	// Alpha Lock (sysdep)
+	{ SDLK_LSHIFT, 6, 2 }, { SDLK_RSHIFT, 6, 2 },
+	{ SDLK_BACKSLASH, 6, 3 },	// MON
+	{ SDLK_RETURN, 6, 4 },
+	// 0x20 apparently unused
+	// MOD
+	// right CTRL may not exist on some laptops ...
+	// for that matter, the iBook doesn't even have RALT
+	{ SDLK_RCTRL, 6, 6 }, { SDLK_RALT, 6, 6 }, { SDLK_KP_ENTER, 6, 6 },
+	{ SDLK_SPACE, 6, 7 },
+
+	// 0xF0 apparently unused
+	{ SDLK_LEFT, 7, 0 }, { SDLK_BACKSPACE, 7, 0 },
+	{ SDLK_UP, 7, 1 },
+	{ SDLK_DOWN, 7, 2 },
+	{ SDLK_RIGHT, 7, 3 },
+
+	{ -1, 0, 0 }
+};
+
+// What each host key presses, as row*8 + bit + 1 (0 for none), and how
+// many host keys are holding each Tutor key down.
+static Uint8 places[SDLK_LAST][KEY_PLACES];
+static Uint8 held[64];
+static int built = 0;
+
+static void Keyboard_Build()
+{
+	KeyMap *k;
+	int i;
+
+	memset(places, 0, sizeof(places));
+	for (k=keymap ; k->sym >= 0 ; k++) {
+		for (i=0 ; i<KEY_PLACES && places[k->sym][i] ; i++);
+		if (i < KEY_PLACES)
+			places[k->sym][i] = k->row * 8 + k->bit + 1;
+	}
+	built = 1;
+	Keyboard_Clear();
+}
+
+// Press or release a host key.
+void Keyboard_Set(int sym, int down)
+{
+	Uint8 *place;
+	int i, p;
+
+	down = (down != 0);
+	if (sym < 0 || sym >= SDLK_LAST || gKeyboard[sym] == down) return;
+	if (!built) Keyboard_Build();
+	gKeyboard[sym] = down;
+	place = places[sym];
+	for (i=0 ; i<KEY_PLACES && place[i] ; i++) {
+		p = place[i] - 1;
+		if (down) {
+			if (!held[p]++)
+				gKeyMatrix[p >> 3] |= 1 << (p & 7);
+		} else if (held[p] && !--held[p])
+			gKeyMatrix[p >> 3] &= ~(1 << (p & 7));
+	}
+}
+
+// Release everything.
+void Keyboard_Clear()
+{
+	memset(gKeyboard, 0, SDLK_LAST);
+	memset(held, 0, sizeof(held));
+	memset(gKeyMatrix, 0, sizeof(gKeyMatrix));
+}
+
+static int Keyboard_Named(char *name)
+{
+	const char *s;
+	char *t;
+	int sym;
+
+	if (*name == '#')
+		return isdigit((unsigned char)name[1]) ? atoi(name + 1) : -1;
+	for (sym=0 ; sym<SDLK_LAST ; sym++) {
+		s = SDL_GetKeyName((SDLKey)sym);
+		for (t=name ; *s && *t &&
+			tolower((unsigned char)*s) == tolower((unsigned char)*t) ;
+			s++, t++);
+		if (!*s && !*t)
+			return sym;
+	}
+	return -1;
+}
+
+/* Load a keymap to use instead of the built-in one. Each line is a row
+   (0 to 7, for EC00 to EC70), a bit (0 to 7) and a host key, by its SDL
+   name ("left shift", "[0]", "1") or as # and its SDLK number ("#49").
+   Other lines, such as ones starting with #, are skipped. SDL's video
+   has to be up first, since that's where the key names come from.
+   Returns nonzero on failure. */
+int Keyboard_LoadMap(char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	char line[256], *name, *end;
+	int entries = 0, row, bit, used, sym;
+
+	if (!f) {
+		perror("keymap");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " %i %i %n", &row, &bit, &used) < 2)
+			continue;
+		name = line + used;
+		end = name + strlen(name);
+		while (end > name && isspace((unsigned char)end[-1]))
+			*--end = 0;
+		sym = Keyboard_Named(name);
+		if (sym < 0 || sym >= SDLK_LAST || row < 0 || row > 7 ||
+				bit < 0 || bit > 7) {
+			fprintf(stderr, "keymap: ignoring %i %i %s\n", row, bit, name);
+			continue;
+		}
+		if (entries == KEYMAP_SIZE - 1) break;
+		keymap[entries].sym = sym;
+		keymap[entries].row = row;
+		keymap[entries].bit = bit;
+		entries++;
+	}
+	fclose(f);
+	if (!entries) return -1;
+	keymap[entries].sym = -1;
+	Keyboard_Build();
+	return 0;
+}
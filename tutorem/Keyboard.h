@@ -0,0 +1,9 @@
+/* Keyboard.h
+	Host keys to the Tutor's key matrix. */
+
+extern char gKeyboard[SDLK_LAST];
+extern Uint8 gKeyMatrix[8];
+
+void Keyboard_Set(int sym, int down);
+void Keyboard_Clear();
+int Keyboard_LoadMap(char *filename);
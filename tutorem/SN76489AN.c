@@ -1,13 +1,18 @@
 /* Tutti II sound emulation
    (C)2015-7 Cameron Kaiser. All rights reserved. */
 
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include "SN76489AN.h"
 
+#if __SSE2__
+#include <emmintrin.h>
+#elif __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #if defined(__clang__) || defined(__GNUC__)
 #  define LIKELY(x)   (__builtin_expect(!!(x), 1))
 #  define UNLIKELY(x) (__builtin_expect(!!(x), 0))
@@ -30,116 +35,471 @@ This is a range of approximately 10 octaves. Hz is computed by
 0x0f is silent, 0x00 is maximum volume (!). We reverse this internally.
 
 The output waveform is approximately a simple "perfect" square wave, although
-there is some analogue distortion in the Tutor's output stage. Here we use a
-simplified approximation, but most Tutor applications did not exercise the DCSG
-very thoroughly, so that will suffice.
+there is some analogue distortion in the Tutor's output stage. We model that
+stage roughly (see SN76489AN_OutputStage): the amplifier rolls off the top
+end, its coupling capacitor blocks DC, and optionally it can be driven into
+soft clipping. Most Tutor applications did not exercise the DCSG very
+thoroughly, so that will suffice.
 
 */
 
+/* The whole model is in integers, so it sounds the same, bit for bit,
+   on every host. It runs at DCSG_CLOCK/DCSG_DIVIDER samples a second
+   (see SN76489AN.h), and Audio.c resamples that for the device. */
+
 /* internal oscillator settings */
 uint8_t vol[4];		// Volume for internal mixer, also a register
-double freqstep[4];	// Step for frequency generator
-double freqstat[4];	// Current position on wave
+uint32_t phase[4];	// Tone phase accumulators, a full cycle is 2^32
+uint32_t phasestep[4];	// Phase step per output sample
+int16_t *wave[4];	// Wavetable in use by each tone channel
+int32_t noisecount;	// Chip clocks until the LFSR next shifts
+int32_t noiseperiod;	// Chip clocks between shifts
 uint16_t noisenet;	// Pseudorandom noise emulation shift register
+uint8_t noiseout;	// Last bit shifted out
 
 /* register status */
 uint8_t latch;
 uint16_t freq[4];
-// We don't track the internal status of the noise register; we
-// don't need to because of the way it is written to by the port.
+uint8_t noisereg;	// Feedback type (bit 2) and shift rate (bits 0-1)
 
 /* biases we use for mixing */
-#define FACTOR 32768.0
-#define AMPMAX 65535.0
+#define FACTOR 32768
+#define AMPMAX 65535
 
 /* precomputed */
 uint8_t allquiet;	// Fast all-clear marker
 uint8_t on[4];		// Which channels are on?
-double volf[4];		// Volume factor (computed from volume)
+int32_t volf[4];	// Volume factor (computed from volume)
+
+// Volume bits to amplitude: each bit increment drops the volume by
+// 2dB. Magic constants determined manually: this is
+// (10^(v*2.02468/20) - 1) * A_AMPLITUDE/32, rounded.
+static const int32_t dBtoamp[16] = {
+	0, 67, 152, 259, 394, 565, 781, 1053,
+	1396, 1830, 2378, 3069, 3942, 5044, 6435, 8192
+};
+
+/* Band-limited square wavetables, in Q15. Table n holds the first n odd
+   harmonics (sin(hx)/h, summed); a tone uses the richest table whose
+   harmonics all stay under the Nyquist frequency, so high notes don't
+   alias. Table 0 is silence, for tones above Nyquist. */
+#define WAVE_BITS	12
+#define WAVE_SIZE	(1 << WAVE_BITS)
+#define WAVE_TABLES	7
+int16_t wavetable[WAVE_TABLES][WAVE_SIZE];
+uint8_t wavebuilt = 0;
 
 // Internal utility functions.
 
 // Caches what's playing, if anything.
 inline void isallquiet() {
-#define ON_ANON(a) on[a] = !(freq[a] == 0 || vol[a] == 0); if(!on[a]) freqstat[a] = 0.0;
+#define ON_ANON(a) on[a] = !(freq[a] == 0 || vol[a] == 0); if(!on[a]) phase[a] = 0;
 	ON_ANON(0)
 	ON_ANON(1)
 	ON_ANON(2)
-	on[3] = !(vol[3] == 0); if (!on[3]) freqstat[3] = 0.0;
+	on[3] = !(vol[3] == 0); if (!on[3]) noisecount = noiseperiod;
 	allquiet = !(on[0] || on[1] || on[2] || on[3]);
 }
 
-// Convert volume bits to amplitude: each bit increment
-// drops the volume by 2dB.
-inline double dBtoamp(uint8_t db) {
-	// Magic constants determined manually.
-	double boost = pow(10.0, ((db*2.02468)/20.0));
-	return (boost - 1) * (A_AMPLITUDE / 32.0);
-}
-
 // Waveform generators.
 
 inline uint8_t noisebit() {
 	// Noise generator. This needs separate processing to generate amplitude
-	// (see SN76489AN_GenerateSamples).
+	// (see noiseblock()).
 	//
-	// The SN76489A uses a 15-bit shift register. Taps are on bits 13 and 14
-	// and the output is bit 15.
+	// The SN76489A uses a 15-bit shift register. White noise feeds back
+	// the parity of bits 0 and 1; periodic noise feeds back bit 0 alone,
+	// so the one set bit goes round every 15 shifts. The output is bit 0.
 	uint8_t newbit;
-	
-	// Compute parity of tapped bits.
-	newbit = ((noisenet & 0x02) && (noisenet & 0x04)) ? 0 :
-			  (noisenet & 0x02) ? 1 :
-			  (noisenet & 0x04) ? 1 : 0;
-	// Feed it back.
-	noisenet |= newbit << 15;
-	
-	// Shift out next pseudorandom bit.
-	newbit = noisenet & 1;
-	noisenet >>= 1;
-	return newbit;
+
+	newbit = (noisereg & 0x04) ? (noisenet ^ (noisenet >> 1)) & 1 :
+		noisenet & 1;
+	noiseout = noisenet & 1;
+	noisenet = (noisenet >> 1) | (newbit << 14);
+	return noiseout;
+}
+
+/* Sine of (i / WAVE_SIZE) of a cycle in Q30, from its Taylor series in
+   fixed point, so the tables don't depend on the host's libm. */
+static int32_t isin(int i) {
+	int64_t x, x2, t;
+	int q = i & (WAVE_SIZE/4 - 1);
+
+	switch ((i >> (WAVE_BITS - 2)) & 3) {
+		case 1: q = WAVE_SIZE/4 - q; break;
+		case 3: q = WAVE_SIZE/4 - q; break;
+	}
+	// pi/2 in Q30, scaled to the quarter wave.
+	x = ((int64_t)1686629713 * q) >> (WAVE_BITS - 2);
+	x2 = (x * x) >> 30;
+	t = (1 << 30) - x2/156;
+	t = (1 << 30) - ((x2 * t) >> 30)/110;
+	t = (1 << 30) - ((x2 * t) >> 30)/72;
+	t = (1 << 30) - ((x2 * t) >> 30)/42;
+	t = (1 << 30) - ((x2 * t) >> 30)/20;
+	t = (1 << 30) - ((x2 * t) >> 30)/6;
+	t = (x * t) >> 30;
+	return (i & (WAVE_SIZE/2)) ? -t : t;
+}
+
+void buildwavetables() {
+	int32_t sine[WAVE_SIZE], sum[WAVE_SIZE];
+	int n, h, i;
+
+	for(i=0; i<WAVE_SIZE; i++) {
+		sine[i] = isin(i);
+		sum[i] = 0;
+		wavetable[0][i] = 0;
+	}
+	for(n=1; n<WAVE_TABLES; n++) {
+		h = 2*n - 1;
+		for(i=0; i<WAVE_SIZE; i++) {
+			sum[i] += sine[(h*i) & (WAVE_SIZE-1)] / h;
+			wavetable[n][i] = (sum[i] + (1 << 14)) >> 15;
+		}
+	}
+	wavebuilt = 1;
+}
+
+/* A tone counter is clocked at DCSG_CLOCK/16 and flips the output each
+   time it counts down from n, so a cycle is 32n chip clocks, and a
+   sample is DCSG_DIVIDER of them. The step is a cycle's worth of 2^32
+   per sample; zero at or above Nyquist. */
+inline uint32_t tonestep(uint16_t n) {
+	if (DCSG_DIVIDER >= 16 * (uint32_t)n)
+		return 0;
+	return (uint32_t)(((uint64_t)DCSG_DIVIDER << 32) / (32 * (uint32_t)n));
+}
+
+// Richest wavetable whose harmonics all fit under Nyquist.
+inline int16_t *wavefor(uint16_t n) {
+	int t = 0;
+
+	while (t < WAVE_TABLES-1 && (2*t + 1) * DCSG_DIVIDER < 16 * (uint32_t)n)
+		t++;
+	return wavetable[t];
 }
 
-inline double envelope(double freqstat, double vol) {
+inline int32_t envelope(uint32_t phase, int16_t *wave, int32_t vol) {
 	// Tone synthesis generator, emitting a ready-to-use amplitude.
 	// Square it off for that harsh Tomy sound!
-	return vol * (sin(freqstat) + sin(3*freqstat)/3 + sin(5*freqstat)/5 + sin(7*freqstat)/7 + sin(9*freqstat)/9 + sin(11*freqstat)/11);
+	return (vol * wave[phase >> (32 - WAVE_BITS)]) >> 15;
 }
 
-inline double mixer(double a, double b) {
+inline int32_t mixer(int32_t a, int32_t b) {
 	// Takes the output of two generators and returns a mixed version.
-	double m;
+	int32_t m;
 
 	// Pre-bias the amplitudes.
 	a += FACTOR;
 	b += FACTOR;
 
 	// Use a high quality mixing algorithm to reduce distortion.
+	// Both inputs are in 0..AMPMAX, so the product fits 32 bits.
 	if (a < FACTOR && b < FACTOR) {
-		m = (a * b) / FACTOR;
+		m = ((uint32_t)a * (uint32_t)b) >> 15;
 	} else {
-		m = (2.0 * (a+b)) - ((a*b) / FACTOR) - AMPMAX;
+		m = (2 * (a+b)) - (int32_t)(((uint32_t)a * (uint32_t)b) >> 15) - AMPMAX;
 	}
 	if (m > AMPMAX) m=AMPMAX;
+	if (m < 0) m=0;
 
 	// Remove the bias and return.
 	return (m - FACTOR);
 }
 
-inline double noisedivider(uint8_t noise) {
-	// The Tomy OS supports clock/512, clock/1024 and clock/2048 for the
-	// noise channel (BASIC -1, -2 and -3 respectively). clock/512 is also
-	// the value used in GBASIC for TONE NO4.
-	if (noise == 4) return (3579545.0/512.0);
-	if (noise == 5) return (3579545.0/1024.0);
-	if (noise == 6) return (3579545.0/2048.0);
-	
-	// It wouldn't be hard to support using channel 2 (i.e., a value of 7),
-	// but the Tomy OS doesn't seem to implement that, so we don't either.
-#if DEBUG
-	fprintf(stderr, "unexpected noise divider: %i\n", noise);
+/* The general mixer works on blocks: each voice is generated into its
+   own buffer and the buffers are combined with mixblock(), which does
+   exactly what mixer() does to each pair, eight at a time. */
+#define MIX_BLOCK 64
+
+void mixblock(int16_t *m, int16_t *a, int16_t *b, int n) {
+	// m may be the same buffer as a or b.
+	int i = 0;
+#if __SSE2__
+	__m128i bias = _mm_set1_epi16((short)0x8000);
+	__m128i zero = _mm_setzero_si128();
+	__m128i ampmax = _mm_set1_epi32(AMPMAX);
+	__m128i factor = _mm_set1_epi32(FACTOR);
+	__m128i ua, ub, hi, lo, low, p, sum, high, mask, r[2];
+	int h;
+
+	for( ; i+8 <= n; i+=8) {
+		// Bias to 0..AMPMAX, then the 32-bit product >> 15 from the
+		// two 16-bit halves.
+		ua = _mm_xor_si128(_mm_loadu_si128((__m128i *)(a+i)), bias);
+		ub = _mm_xor_si128(_mm_loadu_si128((__m128i *)(b+i)), bias);
+		hi = _mm_mulhi_epu16(ua, ub);
+		lo = _mm_mullo_epi16(ua, ub);
+		// All ones where both are under FACTOR.
+		low = _mm_cmpeq_epi16(_mm_srli_epi16(_mm_or_si128(ua, ub), 15), zero);
+		for(h=0; h<2; h++) {
+			if (h) {
+				p = _mm_or_si128(_mm_slli_epi32(_mm_unpackhi_epi16(hi, zero), 1),
+					_mm_srli_epi32(_mm_unpackhi_epi16(lo, zero), 15));
+				sum = _mm_add_epi32(_mm_unpackhi_epi16(ua, zero),
+					_mm_unpackhi_epi16(ub, zero));
+				mask = _mm_unpackhi_epi16(low, low);
+			} else {
+				p = _mm_or_si128(_mm_slli_epi32(_mm_unpacklo_epi16(hi, zero), 1),
+					_mm_srli_epi32(_mm_unpacklo_epi16(lo, zero), 15));
+				sum = _mm_add_epi32(_mm_unpacklo_epi16(ua, zero),
+					_mm_unpacklo_epi16(ub, zero));
+				mask = _mm_unpacklo_epi16(low, low);
+			}
+			high = _mm_sub_epi32(_mm_sub_epi32(_mm_add_epi32(sum, sum), p),
+				ampmax);
+			r[h] = _mm_sub_epi32(_mm_or_si128(_mm_and_si128(mask, p),
+				_mm_andnot_si128(mask, high)), factor);
+		}
+		// Saturating to 16 bits is the clamp to 0..AMPMAX.
+		_mm_storeu_si128((__m128i *)(m+i), _mm_packs_epi32(r[0], r[1]));
+	}
+#elif __ARM_NEON
+	uint16x8_t bias = vdupq_n_u16(0x8000);
+	int32x4_t ampmax = vdupq_n_s32(AMPMAX);
+	int32x4_t factor = vdupq_n_s32(FACTOR);
+	uint16x8_t ua, ub, low;
+	uint32x4_t mask;
+	int32x4_t p, sum, high, r[2];
+	int h;
+
+	for( ; i+8 <= n; i+=8) {
+		ua = veorq_u16(vld1q_u16((uint16_t *)(a+i)), bias);
+		ub = veorq_u16(vld1q_u16((uint16_t *)(b+i)), bias);
+		low = vceqq_u16(vshrq_n_u16(vorrq_u16(ua, ub), 15), vdupq_n_u16(0));
+		for(h=0; h<2; h++) {
+			uint16x4_t xa = h ? vget_high_u16(ua) : vget_low_u16(ua);
+			uint16x4_t xb = h ? vget_high_u16(ub) : vget_low_u16(ub);
+			uint16x4_t xl = h ? vget_high_u16(low) : vget_low_u16(low);
+
+			p = vreinterpretq_s32_u32(vshrq_n_u32(vmull_u16(xa, xb), 15));
+			sum = vreinterpretq_s32_u32(vaddl_u16(xa, xb));
+			mask = vreinterpretq_u32_s32(vmovl_s16(vreinterpret_s16_u16(xl)));
+			high = vsubq_s32(vsubq_s32(vaddq_s32(sum, sum), p), ampmax);
+			r[h] = vsubq_s32(vbslq_s32(mask, p, high), factor);
+		}
+		vst1q_s16(m+i, vcombine_s16(vqmovn_s32(r[0]), vqmovn_s32(r[1])));
+	}
+#endif
+	for( ; i<n; i++)
+		m[i] = (int16_t)mixer(a[i], b[i]);
+}
+
+// One tone channel's next n samples, or silence if it's off.
+void voiceblock(int16_t *out, int c, int n) {
+	int i;
+
+	if (!on[c]) {
+		memset(out, 0, n * sizeof(int16_t));
+		return;
+	}
+	for(i=0; i<n; i++) {
+		out[i] = (int16_t)envelope(phase[c], wave[c], volf[c]);
+		phase[c] += phasestep[c];
+	}
+}
+
+// The noise channel's next n samples, or silence if it's off. The
+// shift register is clocked on a chip clock countdown rather than a
+// phase step, since it can shift more than once a sample when it
+// follows a high tone 2.
+void noiseblock(int16_t *out, int n) {
+	int32_t level = (noiseout) ? volf[3] : -volf[3];
+	int i;
+
+	if (!on[3]) {
+		memset(out, 0, n * sizeof(int16_t));
+		return;
+	}
+	for(i=0; i<n; i++) {
+		out[i] = (int16_t)level;
+		noisecount -= DCSG_DIVIDER;
+		if (UNLIKELY(noisecount <= 0)) {
+			do {
+				noisebit();
+				noisecount += noiseperiod;
+			} while (noisecount <= 0);
+			level = (noiseout) ? volf[3] : -volf[3];
+		}
+	}
+}
+
+inline void noisedivider() {
+	// The noise counter is clocked at DCSG_CLOCK/16 and reloads from
+	// 16, 32 or 64, or follows tone 2's counter, and the register
+	// shifts every other time it runs out. The Tomy OS only uses the
+	// first three, as clock/512, clock/1024 and clock/2048 (BASIC -1,
+	// -2 and -3 respectively); clock/512 is also the value used in
+	// GBASIC for TONE NO4. Cartridges may use the rest.
+	uint32_t n = ((noisereg & 0x03) == 3) ?
+		((freq[2]) ? freq[2] : 0x400) : 16 << (noisereg & 0x03);
+
+	noiseperiod = 32 * n;
+	if (noisecount > noiseperiod) noisecount = noiseperiod;
+}
+
+/* Output stage. The low-pass is a 2nd-order Butterworth at 10kHz for
+   the chip rate, in Q14. Run a sample at a time its feedback makes it
+   serial, so instead it's run four at a time: each of the four outputs
+   is a fixed combination of the six inputs x[n-2..n+3] and the last two
+   outputs y[n-2] and y[n-1] (buildlowpass() works them out), which is
+   a small matrix product and vectorizes well. The DC blocker is a
+   one-pole high-pass at about 35Hz that needs no multiplies at all. */
+#define LP_B0	2838
+#define LP_B1	5678
+#define LP_B2	2838
+#define LP_A1	-8657
+#define LP_A2	3627
+#define DC_SHIFT 8
+
+int16_t lowpass[4][8];	// Q14, output by input term
+int16_t lpx[2], lpy[2];	// Last two inputs and outputs
+int16_t dcx;		// Last input to the DC blocker
+int32_t dcacc;		// Its output, in Q8
+uint8_t softclip = 0;
+
+void buildlowpass() {
+	// Terms are x[n-2..n+3], y[n-2], y[n-1], in Q28 while working.
+	int64_t c[6][8];
+	int i, k;
+
+	memset(c, 0, sizeof(c));
+	c[0][6] = c[1][7] = (int64_t)1 << 28;
+	for(i=0; i<4; i++) {
+		c[i+2][i+2] += (int64_t)LP_B0 << 14;
+		c[i+2][i+1] += (int64_t)LP_B1 << 14;
+		c[i+2][i] += (int64_t)LP_B2 << 14;
+		for(k=0; k<8; k++)
+			c[i+2][k] -= (LP_A1 * c[i+1][k] + LP_A2 * c[i][k] +
+				(1 << 13)) >> 14;
+	}
+	for(i=0; i<4; i++)
+		for(k=0; k<8; k++)
+			lowpass[i][k] = (int16_t)((c[i+2][k] + (1 << 13)) >> 14);
+}
+
+// The first n (at most 4) outputs of the look-ahead low-pass for x.
+void lowpassstep(int16_t *x, int n) {
+	int16_t in[8], out[4];
+	uint32_t sum;
+	int i, k;
+
+	in[0] = lpx[0];
+	in[1] = lpx[1];
+	for(k=0; k<4; k++)
+		in[k+2] = (k < n) ? x[k] : 0;
+	in[6] = lpy[0];
+	in[7] = lpy[1];
+	for(i=0; i<n; i++) {
+		// Wrapping is harmless: only the total has to fit, as in
+		// the SIMD versions.
+		sum = 1 << 13;
+		for(k=0; k<8; k++)
+			sum += (uint32_t)((int32_t)lowpass[i][k] * in[k]);
+		sum = (uint32_t)((int32_t)sum >> 14);
+		out[i] = ((int32_t)sum > 32767) ? 32767 :
+			((int32_t)sum < -32768) ? -32768 : (int16_t)sum;
+	}
+	lpx[0] = (n > 1) ? in[n] : lpx[1];
+	lpx[1] = in[n+1];
+	lpy[0] = (n > 1) ? out[n-2] : lpy[1];
+	lpy[1] = out[n-1];
+	memcpy(x, out, n * sizeof(int16_t));
+}
+
+void lowpassblock(int16_t *x, size_t count) {
+	size_t i = 0;
+#if __SSE2__
+	__m128i col[4], round = _mm_set1_epi32(1 << 13), sum;
+	int16_t out[8];
+	int k;
+
+	// col[k] holds each output's coefficients for terms 2k and 2k+1,
+	// to go with a pair of inputs in every 32-bit lane.
+	for(k=0; k<4; k++)
+		col[k] = _mm_setr_epi16(
+			lowpass[0][2*k], lowpass[0][2*k+1],
+			lowpass[1][2*k], lowpass[1][2*k+1],
+			lowpass[2][2*k], lowpass[2][2*k+1],
+			lowpass[3][2*k], lowpass[3][2*k+1]);
+#define PAIR(a, b) _mm_set1_epi32((uint16_t)(a) | ((uint32_t)(uint16_t)(b) << 16))
+	for( ; i+4 <= count; i+=4) {
+		sum = _mm_add_epi32(
+			_mm_add_epi32(_mm_madd_epi16(PAIR(lpx[0], lpx[1]), col[0]),
+				_mm_madd_epi16(PAIR(x[i], x[i+1]), col[1])),
+			_mm_add_epi32(_mm_madd_epi16(PAIR(x[i+2], x[i+3]), col[2]),
+				_mm_madd_epi16(PAIR(lpy[0], lpy[1]), col[3])));
+		sum = _mm_srai_epi32(_mm_add_epi32(sum, round), 14);
+		_mm_storeu_si128((__m128i *)out, _mm_packs_epi32(sum, sum));
+		lpx[0] = x[i+2];
+		lpx[1] = x[i+3];
+		lpy[0] = out[2];
+		lpy[1] = out[3];
+		memcpy(x+i, out, 4 * sizeof(int16_t));
+	}
+#undef PAIR
+#elif __ARM_NEON
+	int16x4_t col[8];
+	int32x4_t sum;
+	int16x4_t out;
+	int k;
+
+	// col[k] holds each output's coefficient for term k.
+	for(k=0; k<8; k++)
+		col[k] = vld1_s16((int16_t[4]){ lowpass[0][k], lowpass[1][k],
+			lowpass[2][k], lowpass[3][k] });
+	for( ; i+4 <= count; i+=4) {
+		sum = vmull_n_s16(col[0], lpx[0]);
+		sum = vmlal_n_s16(sum, col[1], lpx[1]);
+		sum = vmlal_n_s16(sum, col[2], x[i]);
+		sum = vmlal_n_s16(sum, col[3], x[i+1]);
+		sum = vmlal_n_s16(sum, col[4], x[i+2]);
+		sum = vmlal_n_s16(sum, col[5], x[i+3]);
+		sum = vmlal_n_s16(sum, col[6], lpy[0]);
+		sum = vmlal_n_s16(sum, col[7], lpy[1]);
+		out = vqmovn_s32(vrshrq_n_s32(sum, 14));
+		lpx[0] = x[i+2];
+		lpx[1] = x[i+3];
+		vst1_s16(x+i, out);
+		lpy[0] = x[i+2];
+		lpy[1] = x[i+3];
+	}
+#endif
+	for( ; i<count; i+=4)
+		lowpassstep(x+i, (count - i > 4) ? 4 : count - i);
+}
+
+// Flatten the peaks: y = x - x^3/4, for x in -1..1 as Q15.
+void softclipblock(int16_t *x, size_t count) {
+	size_t i = 0;
+	int32_t x2;
+#if __SSE2__
+	__m128i v, v2;
+
+	for( ; i+8 <= count; i+=8) {
+		v = _mm_loadu_si128((__m128i *)(x+i));
+		v2 = _mm_mulhi_epi16(v, v);
+		_mm_storeu_si128((__m128i *)(x+i),
+			_mm_sub_epi16(v, _mm_mulhi_epi16(v2, v)));
+	}
+#elif __ARM_NEON
+	int16x8_t v;
+	int16x4_t lo, hi;
+
+	for( ; i+8 <= count; i+=8) {
+		v = vld1q_s16(x+i);
+		lo = vshrn_n_s32(vmull_s16(vget_low_s16(v), vget_low_s16(v)), 16);
+		hi = vshrn_n_s32(vmull_s16(vget_high_s16(v), vget_high_s16(v)), 16);
+		lo = vshrn_n_s32(vmull_s16(lo, vget_low_s16(v)), 16);
+		hi = vshrn_n_s32(vmull_s16(hi, vget_high_s16(v)), 16);
+		vst1q_s16(x+i, vsubq_s16(v, vcombine_s16(lo, hi)));
+	}
 #endif
-	return (3579545.0/512.0);
+	for( ; i<count; i++) {
+		x2 = ((int32_t)x[i] * x[i]) >> 16;
+		x[i] -= (int16_t)((x2 * x[i]) >> 16);
+	}
 }
 
 // Public API.
@@ -147,17 +507,29 @@ inline double noisedivider(uint8_t noise) {
 void SN76489AN_Init() {
 	size_t i;
 	
+	if (!wavebuilt) {
+		buildwavetables();
+		buildlowpass();
+	}
 	for(i=0; i<4; i++) {
 		vol[i] = 0x0;
 		freq[i] = 0x0;
-		volf[i] = 0.0;
-		freqstep[i] = 0.0;
-		freqstat[i] = 0.0;
+		volf[i] = 0;
+		phase[i] = 0;
+		phasestep[i] = 0;
+		wave[i] = wavetable[0];
 		on[i] = 0;
 	}
+	noisereg = 0;
+	noisenet = 0x4000;
+	noiseout = 0;
+	noisedivider();
+	noisecount = noiseperiod;
 	latch = 0;
 	allquiet = 1;
-	noisenet = 0x4000; // a guess
+	lpx[0] = lpx[1] = lpy[0] = lpy[1] = 0;
+	dcx = 0;
+	dcacc = 0;
 }
 
 void SN76489AN_WritePort(uint8_t value) {
@@ -176,12 +548,15 @@ void SN76489AN_WritePort(uint8_t value) {
 
 		if (type) { // volume. Precompute factor.		
 			vol[chan] = 15 - data;
-			volf[chan] = dBtoamp(vol[chan]);
+			volf[chan] = dBtoamp[vol[chan]];
 			isallquiet();
 			return;
 		} else { // tone or noise data
 			if (chan == 3) {
-				freqstep[3] = noisedivider(data & 0x07);
+				// Any write here resets the shift register.
+				noisereg = data & 0x07;
+				noisenet = 0x4000;
+				noisedivider();
 				return;
 			}
 			// Place into "low four bits" (that means
@@ -198,12 +573,15 @@ void SN76489AN_WritePort(uint8_t value) {
 
 		if (type) { // volume
 			vol[chan] = 15 - (data & 0x0f);
-			volf[chan] = dBtoamp(vol[chan]);
+			volf[chan] = dBtoamp[vol[chan]];
 			isallquiet();
 			return;
 		} else {
 			if (chan == 3) {
-				freqstep[3] = noisedivider(data & 0x07);
+				// Any write here resets the shift register.
+				noisereg = data & 0x07;
+				noisenet = 0x4000;
+				noisedivider();
 				return;
 			}
 			// Place into "upper six bits"
@@ -212,23 +590,23 @@ void SN76489AN_WritePort(uint8_t value) {
 		}
 	}
 
-	// Update oscillators.
-	// Compute a new step (2 * pi * frequency / sample rate).
+	// Update oscillators: a new phase step and a wavetable for the
+	// frequency.
 	if (freq[chan] == 0) {
-		freqstep[chan] = 0.0;
+		phasestep[chan] = 0;
 	} else {
-		double nufreq;
-
-		nufreq = 3579545.0/(32.0*freq[chan]);
-		freqstep[chan] = 2 * M_PI * nufreq / M_FREQUENCY;
+		phasestep[chan] = tonestep(freq[chan]);
+		wave[chan] = wavefor(freq[chan]);
 	}
+	if (chan == 2 && (noisereg & 0x03) == 3)
+		noisedivider();
 	isallquiet();
 }
 
 void SN76489AN_GenerateSamples(int16_t *buffer, size_t count) {
-	size_t i;
-	uint8_t noisy;
-	double a, b, m;
+	size_t i, n;
+	int c, first;
+	int16_t va[MIX_BLOCK];
 
 	// The Tutor uses channel 2 (of 0-2) for the system tones, plus noise,
 	// and since the same routines service TONE NOa in GBASIC the same
@@ -258,8 +636,8 @@ void SN76489AN_GenerateSamples(int16_t *buffer, size_t count) {
 #define SOLO(x, y, z, a) \
 	if (!on[x] && !on[y] && !on[z]) { \
 		for(i=0; i<count; i++) { \
-			buffer[i] = (int16_t)envelope(freqstat[a], volf[a]); \
-			freqstat[a] += freqstep[a]; \
+			buffer[i] = (int16_t)envelope(phase[a], wave[a], volf[a]); \
+			phase[a] += phasestep[a]; \
 		} \
 		return; \
 	}
@@ -272,44 +650,6 @@ void SN76489AN_GenerateSamples(int16_t *buffer, size_t count) {
 	// (BASIC SOUND() with the minimum number of arguments).
 	SOLO(1,2,3, 0)
 	
-	// Now handle noise with or without channel 2, but no other channels.
-	// We've handled solo 0 and 2, so if channel 1 isn't on, this must be
-	// the situation.
-	if (!on[0] && !on[1]) {
-#if DEBUG
-fprintf(stderr, "sound: noise/2\n");
-#endif
-		noisy = noisebit();
-		if (on[2]) {
-			// Channel 2 plus noise (TONE NO4, etc.).
-			for(i=0; i<count; i++) {
-				a = envelope(freqstat[2], volf[2]);
-				b = (noisy) ? volf[3] : -volf[3];
-				buffer[i] = (int16_t)mixer(a, b);
-				freqstat[2] += freqstep[2];
-				freqstat[3] += freqstep[3];
-				if (freqstat[3] > M_FREQUENCY) {
-					freqstat[3] -= M_FREQUENCY;
-					noisy = noisebit();
-				}
-			}
-			return;
-		}
-		// Noise solo. This can only be triggered in BASIC with
-		// something like SOUND(240,-1,0), but this is documented,
-		// so it's not rare.
-		for(i=0; i<count; i++) {
-			b = (noisy) ? volf[3] : -volf[3];
-			buffer[i] = (int16_t)b;
-			freqstat[3] += freqstep[3];
-			if (freqstat[3] > M_FREQUENCY) {
-				freqstat[3] -= M_FREQUENCY;
-				noisy = noisebit();
-			}
-		}
-		return;
-	}
-				
 	// Now handle channel 1 solo. This can only happen if the channel 0
 	// argument for SOUND() had an amplitude of 30, which will mute it;
 	// it does not occur in GBASIC or the menus. Nevertheless it's still
@@ -317,45 +657,48 @@ fprintf(stderr, "sound: noise/2\n");
 	// inexpensive.
 	SOLO(0,2,3, 1)
 	
-	// For other combinations of voices, we use this multistage mixer.
-	// It does a lot of work inside the loop, so we try to avoid it.
+	// For other combinations of voices, including any with noise, we
+	// use this multistage mixer, a block of each voice at a time (see
+	// mixblock()). The first voice that's on goes straight into the
+	// buffer and the rest are mixed in after it.
 #if DEBUG
 fprintf(stderr, "sound: can't solo, using mixer\n");
 #endif
-#define VOICE(n,v) \
-	if (!on[n]) { \
-		v = 0.0; \
-	} else { \
-		v = envelope(freqstat[n], volf[n]); \
-		freqstat[n] += freqstep[n]; \
+	for(i=0; i<count; i+=n) {
+		n = (count - i > MIX_BLOCK) ? MIX_BLOCK : count - i;
+		first = 1;
+		for(c=0; c<4; c++) {
+			if (!on[c]) continue;
+			if (c == 3)
+				noiseblock((first) ? buffer+i : va, n);
+			else
+				voiceblock((first) ? buffer+i : va, c, n);
+			if (!first)
+				mixblock(buffer+i, buffer+i, va, n);
+			first = 0;
+		}
 	}
+}
+
+/* Run count generated samples through the Tutor's output stage, in
+   place: the low-pass, then the DC blocker, then the soft clip if it's
+   on. */
+void SN76489AN_OutputStage(int16_t *buffer, size_t count) {
+	size_t i;
+	int32_t y;
 
-	if (on[3]) noisy = noisebit(); // Prepare to generate noise.
+	lowpassblock(buffer, count);
 	for(i=0; i<count; i++) {
-		// Mix channels 0 and 1.
-		VOICE(0, a)
-		VOICE(1, b)
-		m = mixer(a, b);
-		
-		// Mix channel 2, if enabled.
-		if (on[2]) {
-			a = envelope(freqstat[2], volf[2]);
-			m = mixer(m, a);
-			freqstat[2] += freqstep[2];
-		}
-		
-		// Mix noise, if enabled, and emit to buffer.
-		if (!on[3]) {
-			buffer[i] = (int16_t)m;
-		} else {
-			b = (noisy) ? volf[3] : -volf[3];
-			buffer[i] = (int16_t)mixer(m, b);
-			freqstat[3] += freqstep[3];
-			if (freqstat[3] > M_FREQUENCY) {
-				freqstat[3] -= M_FREQUENCY;
-				noisy = noisebit();
-			}
-		}
+		dcacc += ((int32_t)buffer[i] - dcx) << DC_SHIFT;
+		dcacc -= dcacc >> DC_SHIFT;
+		dcx = buffer[i];
+		y = (dcacc + (1 << (DC_SHIFT-1))) >> DC_SHIFT;
+		buffer[i] = (y > 32767) ? 32767 : (y < -32768) ? -32768 : y;
 	}
+	if (softclip)
+		softclipblock(buffer, count);
 }
 
+void SN76489AN_SetSoftClip(int on) {
+	softclip = (on != 0);
+}
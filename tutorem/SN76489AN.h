@@ -6,10 +6,22 @@
 #define ENABLE_AUDIO 1
 
 #define A_AMPLITUDE 8192.0
-#define A_FREQUENCY 44100
-#define M_FREQUENCY 44100.0
+#define A_FREQUENCY 44100	// default device rate
+#define A_SAMPLES 512		// default device buffer
+#define A_MIN_FREQUENCY 8000
+#define A_MAX_FREQUENCY 192000
+#define A_MAX_SAMPLES 32768
+
+/* The chip is modelled at DCSG_CLOCK/DCSG_DIVIDER samples per second
+   (about 55.9kHz), where a tone step is 2^33/n whatever the clock. That
+   is truncated, so it is exact only when n is a power of two, but the
+   error is under 2^-32 of a cycle per sample. */
+#define DCSG_CLOCK 3579545
+#define DCSG_DIVIDER 64
 
 void SN76489AN_Init();
 void SN76489AN_WritePort(uint8_t input);
 void SN76489AN_GenerateSamples(int16_t *buffer, size_t count);
+void SN76489AN_OutputStage(int16_t *buffer, size_t count);
+void SN76489AN_SetSoftClip(int on);
 
@@ -8,24 +8,25 @@
    
    Border would be nice in a future version. */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "SDL/SDL.h"
+#include "SDL/SDL_thread.h"
 
 #include "TMS9995.h"
 #include "TMS9918ANL.h"
 #include "Debugger.h"
+#include "Capture.h"
+#include "Timing.h"
 
-/* Allow the Makefile to specify screen size. */
+/* Allow the Makefile to specify the default screen size. It can also be
+   chosen at runtime with TMS9918_SetScale, from 1x to 4x. */
 #ifndef SCREEN_X
 #define SCREEN_X 2
 #endif
 
-#if (SCREEN_X > 2 || SCREEN_X < 1)
-#error Only 1x or 2x screens are currently supported.
-#endif
-
 #if defined(__clang__) || defined(__GNUC__)
 #  define LIKELY(x)   (__builtin_expect(!!(x), 1))
 #  define UNLIKELY(x) (__builtin_expect(!!(x), 0))
@@ -41,6 +42,19 @@
 #if __ALTIVEC__
 #include <assert.h>
 #include <altivec.h>
+#elif __SSE2__
+#include <emmintrin.h>
+#if __SSSE3__
+#include <tmmintrin.h>
+#endif
+#if __AVX2__
+#include <immintrin.h>
+#endif
+#elif __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#if __ALTIVEC__
 
 // Vectors for blitting.
 vector unsigned char permvec1 ALIGN16 =
@@ -66,10 +80,123 @@ typedef struct
 TMS9918_Type VDP_Registers;
 unsigned char VDP_MemoryMap[16384];
 // This has to be global for gcc < 4.4 or it isn't aligned.
-Uint16 pixels[49152] ALIGN16;
+// It holds palette indices, just like the VDP; they are only turned into
+// host colours by TMS9918_Blit.
+// The slack lets sprite spans run a few bytes off the last row.
+Uint8 pixels[49152 + 32] ALIGN16;
 TBYTE lastByte=0x00;
 TWORD VDPUsingAddress=0x0000;
 int skipupdate = 0;
+int screenScale = SCREEN_X;
+
+/* The renderer reads VDP state through these. Normally they point at the
+   live VDP, but with the render thread running they point at whichever
+   snapshot it is drawing. */
+static unsigned char *renderVRAM = VDP_MemoryMap;
+static TMS9918_Type *renderRegisters = &VDP_Registers;
+
+/* Sprite patterns (by number) written since the renderer last looked,
+   one bit each. The renderer gets these with the VDP state it draws and
+   drops the matching entries from its sprite row cache. */
+static Uint32 spritePatternDirty[8] = { ~0U, ~0U, ~0U, ~0U, ~0U, ~0U, ~0U, ~0U };
+static Uint32 *renderSpriteDirty = spritePatternDirty;
+
+/* Render thread. TMS9918_Redraw copies the VDP into whichever snapshot is
+   not being drawn and wakes the thread, which rasterizes, scales and
+   presents it while the CPU carries on. If the thread falls behind, the
+   pending snapshot is simply replaced by a newer one. */
+typedef struct RenderSnapshotStruct
+{
+	unsigned char VRAM[16384];
+	TMS9918_Type Registers;
+	Uint32 SpriteDirty[8];
+	Uint64 micros;	// emulated time, for capture stamps
+} RenderSnapshot;
+
+static RenderSnapshot snapshots[2];
+static SDL_Thread *renderThread = NULL;
+static SDL_mutex *renderLock = NULL;
+static SDL_cond *renderWake = NULL;
+static SDL_cond *renderIdle = NULL;
+static int pendingSnapshot = -1;
+static int renderingSnapshot = -1;
+static int renderQuit = 0;
+
+/* Sprite status from the last frame drawn, and flags posted since the CPU
+   last read the status register. With the render thread running these
+   are shared with it under renderLock. */
+static TBYTE spriteStatus = 0;
+static TBYTE pendingStatus = 0;
+
+/* What each VRAM byte is currently used for, per R0 and R2-R6. A data port
+   write only needs a redraw if it lands in something on screen. */
+#define VRAM_NAME		0x01
+#define VRAM_PATTERN		0x02
+#define VRAM_COLOUR		0x04
+#define VRAM_SPRITE_ATTR	0x08
+#define VRAM_SPRITE_PATTERN	0x10
+
+static Uint8 vramRegion[16384];
+static void TMS9918_ClassifyVRAM();
+static void TMS9918_MakeSpanMasks();
+
+// The sprite pattern table is 2K aligned, so the low bits give the number.
+#define TMS9918_MarkSpritePattern(address) \
+	spritePatternDirty[((address) >> 8) & 7] |= 1U << (((address) >> 3) & 31)
+
+/* Hash of the VDP state last presented. A redraw whose VRAM and registers
+   hash the same (a cursor blink writing back what was there, say) would
+   produce the same picture, so it is dropped before drawing or flipping. */
+static Uint64 presentedHash;
+static int presentedValid = 0;
+static unsigned long elidedFrames = 0;
+
+/* Frames actually drawn and flipped, and the host time that took, since
+   the governor last asked. Elided frames and frames handed to the render
+   thread cost nothing here; the render thread adds its own under
+   renderLock. */
+static int presentCount = 0;
+static long presentMicros = 0;
+
+/* Decoded tile cache. The Tomy OS draws the same small set of glyphs over
+   and over (BASIC text, GRAPHIC tiles), so instead of decoding every cell
+   bit by bit we keep fully rendered 8x8 blocks, keyed on the eight pattern
+   bytes and the eight colour bytes that produced them. The colours in the
+   key are taken after transparent has been replaced by the backdrop in R7,
+   so a change to R7 just misses instead of returning a stale block.
+   Replacement is LRU within each set. */
+#define TC_SETS		256
+#define TC_WAYS		4
+
+typedef union
+{
+	TBYTE b[16];		// pattern rows 0-7, then colour rows 0-7
+	Uint32 w[4];
+} TileKey;
+
+typedef struct TileCacheEntryStruct
+{
+	Uint8 block[64];	// must stay first for alignment
+	TileKey key;
+	Uint32 stamp;		// last use, 0 if empty
+} TileCacheEntry;
+
+static TileCacheEntry tileCache[TC_SETS][TC_WAYS] ALIGN16;
+static Uint32 tileCacheClock = 0;
+static Uint32 tileCacheHits = 0;
+static Uint32 tileCacheMisses = 0;
+
+// Palette mapped to the screen format, recomputed by TMS9918_Init and
+// TMS9918_SetColour. The split tables are the low and high bytes of the
+// first 16 entries, for the byte-shuffle converters.
+static Uint16 mappedColour[17];
+static Uint8 mappedColourLo[16] ALIGN16;
+static Uint8 mappedColourHi[16] ALIGN16;
+#if __SSE2__ && !__SSSE3__
+// Without a byte shuffle, look up two pixels at once: entry a | b << 4
+// is colour a then colour b, as they go in memory.
+static Uint32 mappedPair[256];
+#endif
 
 #define WM_NOTSTARTED		0
 #define WM_BYTE1READY		1
@@ -140,98 +267,803 @@ static RGBValue ColourTable [17] = {
 #endif
 };
 
-void TMS9918_Blit() {
-	// Not for external callers. This does the scaling and blitting.
-	// If we ever need this to be reentrant, we really need a mutex.
-	int i, j, k, l;
-	Uint16 *dst = (Uint16 *)screen->pixels;
+/* Palette conversion. Each row of indices becomes a row of host pixels in
+   a small buffer that stays in cache while it is scaled. The renderer only
+   ever emits indices 0 to 15, which lets us use 16-entry byte shuffles to
+   look up both halves of each colour, or with plain SSE2, a 256-entry
+   table of pixel pairs. */
+
+static Uint16 convertedRow[256] ALIGN16;
+
+static void TMS9918_ConvertRow(Uint8 *src, Uint16 *dst)
+{
+	int k;
 #if __ALTIVEC__
-	vector unsigned short input, output1, output2;
+	vector unsigned char lut_lo = vec_ld(0, mappedColourLo);
+	vector unsigned char lut_hi = vec_ld(0, mappedColourHi);
+	vector unsigned char idx, lo, hi;
+
+	for (k=0; k<256; k+=16) {
+		idx = vec_ld(k, src);
+		lo = vec_perm(lut_lo, lut_lo, idx);
+		hi = vec_perm(lut_hi, lut_hi, idx);
+		// Big endian: high byte first.
+		vec_st((vector unsigned short)vec_mergeh(hi, lo), k+k, dst);
+		vec_st((vector unsigned short)vec_mergel(hi, lo), k+k+16, dst);
+	}
+#elif __SSSE3__
+	__m128i lut_lo = _mm_load_si128((__m128i *)mappedColourLo);
+	__m128i lut_hi = _mm_load_si128((__m128i *)mappedColourHi);
+	__m128i idx, lo, hi;
+
+	for (k=0; k<256; k+=16) {
+		idx = _mm_load_si128((__m128i *)&src[k]);
+		lo = _mm_shuffle_epi8(lut_lo, idx);
+		hi = _mm_shuffle_epi8(lut_hi, idx);
+		_mm_store_si128((__m128i *)&dst[k], _mm_unpacklo_epi8(lo, hi));
+		_mm_store_si128((__m128i *)&dst[k+8], _mm_unpackhi_epi8(lo, hi));
+	}
+#elif __SSE2__
+	__m128i mask = _mm_set1_epi16(0x00ff);
+	__m128i idx, pair;
+	Uint32 *out = (Uint32 *)dst;
+
+	for (k=0; k<256; k+=16) {
+		// Each 16-bit lane holds two indices; fold them into one
+		// byte, second pixel in the high nibble.
+		idx = _mm_load_si128((__m128i *)&src[k]);
+		pair = _mm_or_si128(_mm_and_si128(idx, mask),
+			_mm_srli_epi16(idx, 4));
+		out[0] = mappedPair[_mm_extract_epi16(pair, 0)];
+		out[1] = mappedPair[_mm_extract_epi16(pair, 1)];
+		out[2] = mappedPair[_mm_extract_epi16(pair, 2)];
+		out[3] = mappedPair[_mm_extract_epi16(pair, 3)];
+		out[4] = mappedPair[_mm_extract_epi16(pair, 4)];
+		out[5] = mappedPair[_mm_extract_epi16(pair, 5)];
+		out[6] = mappedPair[_mm_extract_epi16(pair, 6)];
+		out[7] = mappedPair[_mm_extract_epi16(pair, 7)];
+		out += 8;
+	}
+#elif __ARM_NEON && __aarch64__
+	uint8x16_t lut_lo = vld1q_u8(mappedColourLo);
+	uint8x16_t lut_hi = vld1q_u8(mappedColourHi);
+	uint8x16_t idx;
+	uint8x16x2_t out;
+
+	for (k=0; k<256; k+=16) {
+		idx = vld1q_u8(&src[k]);
+		out.val[0] = vqtbl1q_u8(lut_lo, idx);
+		out.val[1] = vqtbl1q_u8(lut_hi, idx);
+		// Little endian: interleave low byte first.
+		vst2q_u8((uint8_t *)&dst[k], out);
+	}
+#else
+	for (k=0; k<256; k+=8) {
+		dst[k  ] = mappedColour[src[k  ]];
+		dst[k+1] = mappedColour[src[k+1]];
+		dst[k+2] = mappedColour[src[k+2]];
+		dst[k+3] = mappedColour[src[k+3]];
+		dst[k+4] = mappedColour[src[k+4]];
+		dst[k+5] = mappedColour[src[k+5]];
+		dst[k+6] = mappedColour[src[k+6]];
+		dst[k+7] = mappedColour[src[k+7]];
+	}
+#endif
+}
 
-	vec_dstt(pixels, 32, 0);
-	vec_dststt(dst, ((64 << 24) | 64), 1);
-	vec_dststt((Uint16 *)(dst + 512), ((64 << 24) | 64), 2);
+static void TMS9918_MapFilterColours();
+
+static void TMS9918_MapColours()
+{
+	int i;
+
+	for (i=0 ; i<17 ; i++)
+		mappedColour[i] = SDL_MapRGB(screen->format, ColourTable[i].r,
+			ColourTable[i].g, ColourTable[i].b);
+	for (i=0 ; i<16 ; i++) {
+		mappedColourLo[i] = mappedColour[i] & 0xff;
+		mappedColourHi[i] = mappedColour[i] >> 8;
+	}
+#if __SSE2__ && !__SSSE3__
+	for (i=0 ; i<256 ; i++)
+		mappedPair[i] = mappedColour[i & 15] |
+			((Uint32)mappedColour[i >> 4] << 16);
 #endif
+	TMS9918_MapFilterColours();
+}
+
+/* Change a palette entry. Since the backing buffer holds indices, this
+   takes effect with just a blit. */
+void TMS9918_SetColour(int entry, int r, int g, int b)
+{
+	if (entry < 0 || entry > 16) return;
+	// The render thread maps through these tables.
+	TMS9918_Sync();
+	ColourTable[entry].r = r;
+	ColourTable[entry].g = g;
+	ColourTable[entry].b = b;
+	if (screen) {
+		TMS9918_MapColours();
+		TMS9918_Blit();
+	}
+}
+
+/* Load a palette from a text file of up to 17 "r g b" lines, in VDP colour
+   order. Returns nonzero on failure. */
+int TMS9918_LoadPalette(char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	int entry = 0, r, g, b;
+
+	if (!f) {
+		perror("palette");
+		return -1;
+	}
+	while (entry < 17 && fscanf(f, "%i %i %i", &r, &g, &b) == 3)
+		TMS9918_SetColour(entry++, r & 0xff, g & 0xff, b & 0xff);
+	fclose(f);
+	return (entry) ? 0 : -1;
+}
+
+/* Scalers. Each one takes one converted 256-pixel row and
+   writes all of the output rows it becomes, so that every output row is
+   written exactly once instead of being copied back out of the display.
+   Where we can, we widen with shuffles and use non-temporal stores, since
+   we never read the display back. */
+
+typedef void (*ScaleRowFunc)(Uint16 *src, Uint8 *dst, int pitch);
+static ScaleRowFunc scaleRow;
+
+static void TMS9918_ScaleRow_C(Uint16 *src, Uint8 *dst, int pitch)
+{
+	// Pure C version for any scale. Build the first row, then copy it.
+	Uint16 *out = (Uint16 *)dst;
+	int i, j;
+
+	if (screenScale == 1) {
+		// Favour memcpy() because it is often SIMD-powered.
+		memcpy(dst, src, 512);
+		return;
+	}
+	for (i=0; i<256; i++) {
+		Uint16 p = src[i];
+		for (j=0; j<screenScale; j++)
+			*out++ = p;
+	}
+	for (j=1; j<screenScale; j++)
+		memcpy(dst + j * pitch, dst, 512 * screenScale);
+}
 
-	if ( SDL_MUSTLOCK(screen) ) SDL_LockSurface(screen);
-#if (SCREEN_X == 1)
-	// Blit the screen. Favour memcpy() because it is often SIMD-powered.
-	memcpy((void *)screen->pixels, (void *)pixels, 256 * 192 * 2);
-#elif (SCREEN_X == 2)
-	// AltiVec and pure C versions follow.
-	for (i=0; i<49152; i+= 256) {
 #if __ALTIVEC__
-		for (k=i; k<i+256; k+=16) {
-			// AltiVec version. Load eight 16-bit source pixels,
-			// then vperm them into two output vectors. Unroll
-			// it a bit and store into the next row while we're
-			// at it.
-			input = vec_ld(0, &(pixels[k]));
-			// Seems to work best interleaving perms and LSU ops
-			// since G4e can put the perms simultaneously with
-			// the load/stores and the G5 only has one perm unit
-			// anyway.
-			output1 = vec_perm(input, input, permvec1);
-			vec_st(output1,    0, dst);
-			output2 = vec_perm(input, input, permvec2);
-			vec_st(output1, 1024, dst);
-			input = vec_ld(16, &(pixels[k]));
-			vec_st(output2,   16, dst);
-			output1 = vec_perm(input, input, permvec1);
-			vec_st(output2, 1040, dst);
-			output2 = vec_perm(input, input, permvec2);
-			vec_st(output1,   32, dst);
-			vec_st(output1, 1056, dst);
-			vec_st(output2,   48, dst);
-			vec_st(output2, 1072, dst);
-			dst += 32;
+static void TMS9918_ScaleRow2x_AltiVec(Uint16 *src, Uint8 *dst, int pitch)
+{
+	// Load eight 16-bit source pixels, then vperm them into two output
+	// vectors. Unroll it a bit and store into the next row while we're
+	// at it.
+	vector unsigned short input, output1, output2;
+	Uint16 *out = (Uint16 *)dst;
+	int k;
+
+	for (k=0; k<256; k+=16) {
+		input = vec_ld(0, &(src[k]));
+		// Seems to work best interleaving perms and LSU ops
+		// since G4e can put the perms simultaneously with
+		// the load/stores and the G5 only has one perm unit
+		// anyway.
+		output1 = vec_perm(input, input, permvec1);
+		vec_st(output1,    0, out);
+		output2 = vec_perm(input, input, permvec2);
+		vec_st(output1, pitch, out);
+		input = vec_ld(16, &(src[k]));
+		vec_st(output2,   16, out);
+		output1 = vec_perm(input, input, permvec1);
+		vec_st(output2, pitch+16, out);
+		output2 = vec_perm(input, input, permvec2);
+		vec_st(output1,   32, out);
+		vec_st(output1, pitch+32, out);
+		vec_st(output2,   48, out);
+		vec_st(output2, pitch+48, out);
+		out += 32;
+	}
+}
+#endif
+
+#if __SSE2__
+/* Each SSE2 kernel comes in a streaming version for aligned displays and
+   an unaligned version for everything else. */
+#define SSE2_ROWS(v, off) \
+	for (r=0; r<SCALE; r++) STORE((__m128i *)(dst + r*pitch + (off)), (v));
+
+#define SSE2_KERNEL1(NAME) \
+static void NAME(Uint16 *src, Uint8 *dst, int pitch) \
+{ \
+	int k; \
+	for (k=0; k<256; k+=8) \
+		STORE((__m128i *)(dst + k*2), \
+			_mm_load_si128((__m128i *)&src[k])); \
+}
+
+#define SSE2_KERNEL2(NAME) \
+static void NAME(Uint16 *src, Uint8 *dst, int pitch) \
+{ \
+	__m128i v, lo, hi; \
+	int k, r; \
+	for (k=0; k<256; k+=8) { \
+		v = _mm_load_si128((__m128i *)&src[k]); \
+		lo = _mm_unpacklo_epi16(v, v); \
+		hi = _mm_unpackhi_epi16(v, v); \
+		SSE2_ROWS(lo, k*4) \
+		SSE2_ROWS(hi, k*4+16) \
+	} \
+}
+
+/* SSE2 has no byte shuffle, so 3x assembles each output vector from a
+   low and high half made with word shuffles. */
+#define SSE2_LOHI(lo, hi) _mm_castpd_si128(_mm_move_sd( \
+	_mm_castsi128_pd(hi), _mm_castsi128_pd(lo)))
+#define SSE2_KERNEL3(NAME) \
+static void NAME(Uint16 *src, Uint8 *dst, int pitch) \
+{ \
+	__m128i v, o0, o1, o2; \
+	int k, r; \
+	for (k=0; k<256; k+=8) { \
+		v = _mm_load_si128((__m128i *)&src[k]); \
+		o0 = SSE2_LOHI(_mm_shufflelo_epi16(v, _MM_SHUFFLE(1,0,0,0)), \
+			_mm_shufflehi_epi16(_mm_slli_si128(v, 6), \
+				_MM_SHUFFLE(1,1,0,0))); \
+		o1 = SSE2_LOHI(_mm_shufflelo_epi16(_mm_srli_si128(v, 4), \
+				_MM_SHUFFLE(1,1,1,0)), \
+			_mm_shufflehi_epi16(v, _MM_SHUFFLE(1,0,0,0))); \
+		o2 = SSE2_LOHI(_mm_shufflelo_epi16(_mm_srli_si128(v, 8), \
+				_MM_SHUFFLE(2,2,1,1)), \
+			_mm_shufflehi_epi16(v, _MM_SHUFFLE(3,3,3,2))); \
+		SSE2_ROWS(o0, k*6) \
+		SSE2_ROWS(o1, k*6+16) \
+		SSE2_ROWS(o2, k*6+32) \
+	} \
+}
+
+#define SSE2_KERNEL4(NAME) \
+static void NAME(Uint16 *src, Uint8 *dst, int pitch) \
+{ \
+	__m128i v, lo, hi; \
+	int k, r; \
+	for (k=0; k<256; k+=8) { \
+		v = _mm_load_si128((__m128i *)&src[k]); \
+		lo = _mm_unpacklo_epi16(v, v); \
+		hi = _mm_unpackhi_epi16(v, v); \
+		SSE2_ROWS(_mm_unpacklo_epi32(lo, lo), k*8) \
+		SSE2_ROWS(_mm_unpackhi_epi32(lo, lo), k*8+16) \
+		SSE2_ROWS(_mm_unpacklo_epi32(hi, hi), k*8+32) \
+		SSE2_ROWS(_mm_unpackhi_epi32(hi, hi), k*8+48) \
+	} \
+}
+
+#define STORE _mm_stream_si128
+#define SCALE 1
+SSE2_KERNEL1(TMS9918_ScaleRow1x_SSE2_NT)
+#undef SCALE
+#define SCALE 2
+SSE2_KERNEL2(TMS9918_ScaleRow2x_SSE2_NT)
+#undef SCALE
+#define SCALE 3
+SSE2_KERNEL3(TMS9918_ScaleRow3x_SSE2_NT)
+#undef SCALE
+#define SCALE 4
+SSE2_KERNEL4(TMS9918_ScaleRow4x_SSE2_NT)
+#undef SCALE
+#undef STORE
+#define STORE _mm_storeu_si128
+#define SCALE 1
+SSE2_KERNEL1(TMS9918_ScaleRow1x_SSE2)
+#undef SCALE
+#define SCALE 2
+SSE2_KERNEL2(TMS9918_ScaleRow2x_SSE2)
+#undef SCALE
+#define SCALE 3
+SSE2_KERNEL3(TMS9918_ScaleRow3x_SSE2)
+#undef SCALE
+#define SCALE 4
+SSE2_KERNEL4(TMS9918_ScaleRow4x_SSE2)
+#undef SCALE
+#undef STORE
+
+#if __AVX2__
+/* AVX2 unpacks work within 128-bit lanes, so put the halves back in
+   order with a cross-lane permute. Only used for 32-byte aligned displays. */
+static void TMS9918_ScaleRow2x_AVX2(Uint16 *src, Uint8 *dst, int pitch)
+{
+	__m256i v, lo, hi, o0, o1;
+	int k;
+
+	for (k=0; k<256; k+=16) {
+		v = _mm256_loadu_si256((__m256i *)&src[k]);
+		lo = _mm256_unpacklo_epi16(v, v);
+		hi = _mm256_unpackhi_epi16(v, v);
+		o0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+		o1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+		_mm256_stream_si256((__m256i *)(dst + k*4), o0);
+		_mm256_stream_si256((__m256i *)(dst + k*4 + 32), o1);
+		_mm256_stream_si256((__m256i *)(dst + pitch + k*4), o0);
+		_mm256_stream_si256((__m256i *)(dst + pitch + k*4 + 32), o1);
+	}
+}
+
+static void TMS9918_ScaleRow4x_AVX2(Uint16 *src, Uint8 *dst, int pitch)
+{
+	__m256i v, lo, hi, a, b, o[4];
+	int k, r;
+
+	for (k=0; k<256; k+=16) {
+		v = _mm256_loadu_si256((__m256i *)&src[k]);
+		lo = _mm256_unpacklo_epi16(v, v);
+		hi = _mm256_unpackhi_epi16(v, v);
+		a = _mm256_permute2x128_si256(lo, hi, 0x20);
+		b = _mm256_permute2x128_si256(lo, hi, 0x31);
+		// a and b are now 2x; do it again for 4x.
+		lo = _mm256_unpacklo_epi16(a, a);
+		hi = _mm256_unpackhi_epi16(a, a);
+		o[0] = _mm256_permute2x128_si256(lo, hi, 0x20);
+		o[1] = _mm256_permute2x128_si256(lo, hi, 0x31);
+		lo = _mm256_unpacklo_epi16(b, b);
+		hi = _mm256_unpackhi_epi16(b, b);
+		o[2] = _mm256_permute2x128_si256(lo, hi, 0x20);
+		o[3] = _mm256_permute2x128_si256(lo, hi, 0x31);
+		for (r=0; r<4; r++) {
+			Uint8 *row = dst + r*pitch + k*8;
+			_mm256_stream_si256((__m256i *)(row), o[0]);
+			_mm256_stream_si256((__m256i *)(row + 32), o[1]);
+			_mm256_stream_si256((__m256i *)(row + 64), o[2]);
+			_mm256_stream_si256((__m256i *)(row + 96), o[3]);
 		}
-		dst += 512;
-#else
-		for (k=i; k<i+256; k+=8) {
-			// Unrolled C version. Fast enough on icky Intel Macs.
-			*dst++ = pixels[k];
-			*dst++ = pixels[k];
-			*dst++ = pixels[k+1];
-			*dst++ = pixels[k+1];
-			*dst++ = pixels[k+2];
-			*dst++ = pixels[k+2];
-			*dst++ = pixels[k+3];
-			*dst++ = pixels[k+3];
-			*dst++ = pixels[k+4];
-			*dst++ = pixels[k+4];
-			*dst++ = pixels[k+5];
-			*dst++ = pixels[k+5];
-			*dst++ = pixels[k+6];
-			*dst++ = pixels[k+6];
-			*dst++ = pixels[k+7];
-			*dst++ = pixels[k+7];
+	}
+}
+#endif
+#endif
+
+#if __ARM_NEON
+/* NEON's interleaving stores do the widening for us. There is no
+   non-temporal store to use here. */
+static void TMS9918_ScaleRow_NEON(Uint16 *src, Uint8 *dst, int pitch)
+{
+	uint16x8_t v;
+	int k, r;
+
+	for (k=0; k<256; k+=8) {
+		v = vld1q_u16(&src[k]);
+		for (r=0; r<screenScale; r++) {
+			uint16_t *row = (uint16_t *)(dst + r*pitch) +
+				k*screenScale;
+			switch (screenScale) {
+				case 1: vst1q_u16(row, v); break;
+				case 2: { uint16x8x2_t o = { { v, v } };
+					vst2q_u16(row, o); break; }
+				case 3: { uint16x8x3_t o = { { v, v, v } };
+					vst3q_u16(row, o); break; }
+				default: { uint16x8x4_t o = { { v, v, v, v } };
+					vst4q_u16(row, o); break; }
+			}
+		}
+	}
+}
+#endif
+
+static void TMS9918_SelectScaler()
+{
+	scaleRow = TMS9918_ScaleRow_C;
+#if __ALTIVEC__
+	if (screenScale == 2)
+		scaleRow = TMS9918_ScaleRow2x_AltiVec;
+#elif __SSE2__
+	if (!((uintptr_t)(screen->pixels) & 0x0f) && !(screen->pitch & 0x0f)) {
+		ScaleRowFunc nt[4] = {
+			TMS9918_ScaleRow1x_SSE2_NT, TMS9918_ScaleRow2x_SSE2_NT,
+			TMS9918_ScaleRow3x_SSE2_NT, TMS9918_ScaleRow4x_SSE2_NT };
+		scaleRow = nt[screenScale - 1];
+#if __AVX2__
+		if (!((uintptr_t)(screen->pixels) & 0x1f) &&
+				!(screen->pitch & 0x1f)) {
+			if (screenScale == 2)
+				scaleRow = TMS9918_ScaleRow2x_AVX2;
+			if (screenScale == 4)
+				scaleRow = TMS9918_ScaleRow4x_AVX2;
 		}
-		// Dup the row with a memcpy().
-		memcpy((void *)dst, (void *)(dst - 512), 1024);
-		dst += 512;
 #endif
+	} else {
+		ScaleRowFunc un[4] = {
+			TMS9918_ScaleRow1x_SSE2, TMS9918_ScaleRow2x_SSE2,
+			TMS9918_ScaleRow3x_SSE2, TMS9918_ScaleRow4x_SSE2 };
+		scaleRow = un[screenScale - 1];
 	}
-#else
-#error NYI
+#elif __ARM_NEON
+	scaleRow = TMS9918_ScaleRow_NEON;
+#endif
+}
+
+void TMS9918_SetScale(int scale)
+{
+	if (scale < 1) scale = 1;
+	if (scale > 4) scale = 4;
+	screenScale = scale;
+}
+
+/* Post-processing filters. Instead of the plain scalers, BlitFrame can run
+   one of these over the backing buffer:
+   - scanlines: the last output row of each source row at half brightness
+   - crt: scanlines, plus each source pixel's first column blended with
+     its left neighbour
+   - smooth: Scale2x/Scale3x edge-directed scaling (Scale2x twice for 4x)
+   They work on palette indices, so edge tests are exact compares and
+   shading is a table lookup. The frame is cut into horizontal bands done
+   in parallel by a small pool of worker threads; the calling thread takes
+   the first band itself. */
+#define FILTER_MAX_THREADS	8
+
+static int screenFilter = FILTER_NONE;
+static int filterBands = 4;
+static SDL_Thread *filterWorker[FILTER_MAX_THREADS];
+static SDL_sem *filterGo[FILTER_MAX_THREADS];
+static SDL_sem *filterDone = NULL;
+static int filterWorkers = 0;
+static int filterQuit = 0;
+static Uint8 *filterDst;
+static int filterPitch;
+static Uint8 *filterScratch[FILTER_MAX_THREADS];
+
+static Uint16 shadedColour[16];
+static Uint16 blendedColour[16][16];
+static Uint16 blendedShade[16][16];
+
+static void TMS9918_MapFilterColours()
+{
+	int i, j, r, g, b;
+
+	for (i=0 ; i<16 ; i++) {
+		shadedColour[i] = SDL_MapRGB(screen->format,
+			ColourTable[i].r >> 1, ColourTable[i].g >> 1,
+			ColourTable[i].b >> 1);
+		for (j=0 ; j<16 ; j++) {
+			r = (ColourTable[i].r + ColourTable[j].r) >> 1;
+			g = (ColourTable[i].g + ColourTable[j].g) >> 1;
+			b = (ColourTable[i].b + ColourTable[j].b) >> 1;
+			blendedColour[i][j] = SDL_MapRGB(screen->format, r, g, b);
+			blendedShade[i][j] = SDL_MapRGB(screen->format,
+				r >> 1, g >> 1, b >> 1);
+		}
+	}
+}
+
+int TMS9918_FilterNamed(char *name)
+{
+	if (!strcmp(name, "none")) return FILTER_NONE;
+	if (!strcmp(name, "scanlines")) return FILTER_SCANLINES;
+	if (!strcmp(name, "crt")) return FILTER_CRT;
+	if (!strcmp(name, "smooth")) return FILTER_SMOOTH;
+	return -1;
+}
+
+static inline Uint8 *TMS9918_SourceRow(int y)
+{
+	if (y < 0) y = 0;
+	if (y > 191) y = 191;
+	return &pixels[y << 8];
+}
+
+// Output one row of indices, each pixel repeated rep times.
+static void TMS9918_FilterRow(Uint8 *src, int width, int rep, Uint16 *table,
+	Uint16 *out)
+{
+	int x, k;
+	Uint16 c;
+
+	for (x=0 ; x<width ; x++) {
+		c = table[src[x]];
+		for (k=0 ; k<rep ; k++)
+			*out++ = c;
+	}
+}
+
+// As above, but the first copy of each pixel blends with its neighbour.
+static void TMS9918_FilterRowCRT(Uint8 *src, int rep, Uint16 *table,
+	Uint16 (*blend)[16], Uint16 *out)
+{
+	int x, k;
+	Uint8 left = src[0];
+
+	for (x=0 ; x<256 ; x++) {
+		*out++ = blend[left][src[x]];
+		for (k=1 ; k<rep ; k++)
+			*out++ = table[src[x]];
+		left = src[x];
+	}
+}
+
+/* Scale2x on one row of indices, with the rows above and below, into two
+   rows twice as wide. */
+static void TMS9918_Scale2xRow(Uint8 *above, Uint8 *row, Uint8 *below,
+	int width, Uint8 *out0, Uint8 *out1)
+{
+	int x;
+	Uint8 B, D, E, F, H;
+
+	for (x=0 ; x<width ; x++) {
+		B = above[x];
+		E = row[x];
+		H = below[x];
+		D = row[x ? x-1 : 0];
+		F = row[x < width-1 ? x+1 : x];
+		if (B != H && D != F) {
+			out0[x+x] = (D == B) ? D : E;
+			out0[x+x+1] = (B == F) ? F : E;
+			out1[x+x] = (D == H) ? D : E;
+			out1[x+x+1] = (H == F) ? F : E;
+		} else {
+			out0[x+x] = out0[x+x+1] = E;
+			out1[x+x] = out1[x+x+1] = E;
+		}
+	}
+}
+
+// Scale3x (AdvMAME3x) on one row of source pixels into three rows.
+static void TMS9918_Scale3xRow(Uint8 *above, Uint8 *row, Uint8 *below,
+	Uint8 *out0, Uint8 *out1, Uint8 *out2)
+{
+	int x, l, r, o;
+	Uint8 A, B, C, D, E, F, G, H, I;
+
+	for (x=0 ; x<256 ; x++) {
+		l = x ? x-1 : 0;
+		r = x < 255 ? x+1 : x;
+		o = x * 3;
+		A = above[l]; B = above[x]; C = above[r];
+		D = row[l];   E = row[x];   F = row[r];
+		G = below[l]; H = below[x]; I = below[r];
+		if (B != H && D != F) {
+			out0[o] = (D == B) ? D : E;
+			out0[o+1] = ((D == B && E != C) || (B == F && E != A)) ? B : E;
+			out0[o+2] = (B == F) ? F : E;
+			out1[o] = ((D == B && E != G) || (D == H && E != A)) ? D : E;
+			out1[o+1] = E;
+			out1[o+2] = ((B == F && E != I) || (H == F && E != C)) ? F : E;
+			out2[o] = (D == H) ? D : E;
+			out2[o+1] = ((D == H && E != I) || (H == F && E != G)) ? H : E;
+			out2[o+2] = (H == F) ? F : E;
+		} else {
+			out0[o] = out0[o+1] = out0[o+2] = E;
+			out1[o] = out1[o+1] = out1[o+2] = E;
+			out2[o] = out2[o+1] = out2[o+2] = E;
+		}
+	}
+}
+
+static void TMS9918_FilterBand(int band)
+{
+	int y0 = 192 * band / filterBands, y1 = 192 * (band+1) / filterBands;
+	int y, k, r, first, last;
+	Uint8 rows[4][1024], *mid, *src;
+	Uint16 *out;
+
+#define OUTROW(n) ((Uint16 *)(filterDst + (n) * filterPitch))
+	switch (screenFilter) {
+	case FILTER_SCANLINES:
+	case FILTER_CRT:
+		for (y=y0 ; y<y1 ; y++) {
+			src = TMS9918_SourceRow(y);
+			for (k=0 ; k<screenScale ; k++) {
+				out = OUTROW(y * screenScale + k);
+				// With 1x there is nowhere to put a scanline.
+				if (k == screenScale-1 && k) {
+					if (screenFilter == FILTER_CRT)
+						TMS9918_FilterRowCRT(src, screenScale,
+							shadedColour, blendedShade, out);
+					else
+						TMS9918_FilterRow(src, 256, screenScale,
+							shadedColour, out);
+				} else if (screenFilter == FILTER_CRT)
+					TMS9918_FilterRowCRT(src, screenScale,
+						mappedColour, blendedColour, out);
+				else
+					TMS9918_FilterRow(src, 256, screenScale,
+						mappedColour, out);
+			}
+		}
+		break;
+	case FILTER_SMOOTH:
+		switch (screenScale) {
+		case 1:
+			for (y=y0 ; y<y1 ; y++)
+				TMS9918_FilterRow(TMS9918_SourceRow(y), 256, 1,
+					mappedColour, OUTROW(y));
+			break;
+		case 2:
+			for (y=y0 ; y<y1 ; y++) {
+				TMS9918_Scale2xRow(TMS9918_SourceRow(y-1),
+					TMS9918_SourceRow(y), TMS9918_SourceRow(y+1),
+					256, rows[0], rows[1]);
+				TMS9918_FilterRow(rows[0], 512, 1, mappedColour,
+					OUTROW(y+y));
+				TMS9918_FilterRow(rows[1], 512, 1, mappedColour,
+					OUTROW(y+y+1));
+			}
+			break;
+		case 3:
+			for (y=y0 ; y<y1 ; y++) {
+				TMS9918_Scale3xRow(TMS9918_SourceRow(y-1),
+					TMS9918_SourceRow(y), TMS9918_SourceRow(y+1),
+					rows[0], rows[1], rows[2]);
+				for (k=0 ; k<3 ; k++)
+					TMS9918_FilterRow(rows[k], 768, 1,
+						mappedColour, OUTROW(y*3+k));
+			}
+			break;
+		case 4:
+			/* Scale2x the band, plus a row either side, into scratch,
+			   then Scale2x that. */
+			first = (y0 > 0) ? y0-1 : 0;
+			last = (y1 < 192) ? y1 : 191;
+			mid = filterScratch[band];
+			for (y=first ; y<=last ; y++)
+				TMS9918_Scale2xRow(TMS9918_SourceRow(y-1),
+					TMS9918_SourceRow(y), TMS9918_SourceRow(y+1),
+					256, mid + (y-first)*1024, mid + (y-first)*1024+512);
+#define MIDROW(n) (mid + (((n) < 0 ? 0 : (n) > 383 ? 383 : (n)) - first*2) * 512)
+			for (r=y0*2 ; r<y1*2 ; r++) {
+				TMS9918_Scale2xRow(MIDROW(r-1), MIDROW(r), MIDROW(r+1),
+					512, rows[0], rows[1]);
+				TMS9918_FilterRow(rows[0], 1024, 1, mappedColour,
+					OUTROW(r+r));
+				TMS9918_FilterRow(rows[1], 1024, 1, mappedColour,
+					OUTROW(r+r+1));
+			}
+#undef MIDROW
+			break;
+		}
+		break;
+	}
+#undef OUTROW
+}
+
+static int TMS9918_FilterWorker(void *arg)
+{
+	int band = (int)(intptr_t)arg;
+
+	for(;;) {
+		SDL_SemWait(filterGo[band]);
+		if (filterQuit) break;
+		TMS9918_FilterBand(band);
+		SDL_SemPost(filterDone);
+	}
+	return 0;
+}
+
+static void TMS9918_StopFilterWorkers()
+{
+	int i;
+
+	if (!filterWorkers) return;
+	filterQuit = 1;
+	for (i=1 ; i<filterWorkers ; i++)
+		SDL_SemPost(filterGo[i]);
+	for (i=1 ; i<filterWorkers ; i++) {
+		SDL_WaitThread(filterWorker[i], NULL);
+		SDL_DestroySemaphore(filterGo[i]);
+	}
+	SDL_DestroySemaphore(filterDone);
+	filterDone = NULL;
+	filterWorkers = 0;
+	filterQuit = 0;
+}
+
+static void TMS9918_StartFilterWorkers()
+{
+	int i;
+
+	filterDone = SDL_CreateSemaphore(0);
+	for (i=0 ; i<filterBands ; i++) {
+		if (!filterScratch[i])
+			filterScratch[i] = malloc((192 / filterBands + 3) * 1024);
+		if (!i) continue;
+		filterGo[i] = SDL_CreateSemaphore(0);
+		filterWorker[i] = SDL_CreateThread(TMS9918_FilterWorker,
+			(void *)(intptr_t)i);
+	}
+	filterWorkers = filterBands;
+}
+
+/* Choose a filter and how many bands (threads) to run it on. With one
+   band it runs on the calling thread. */
+void TMS9918_SetFilter(int filter, int threads)
+{
+	int i;
+
+	TMS9918_Sync();
+	TMS9918_StopFilterWorkers();
+	if (threads < 1) threads = 1;
+	if (threads > FILTER_MAX_THREADS) threads = FILTER_MAX_THREADS;
+	for (i=0 ; i<FILTER_MAX_THREADS ; i++) {
+		free(filterScratch[i]);
+		filterScratch[i] = NULL;
+	}
+	screenFilter = filter;
+	filterBands = threads;
+}
+
+// Run the current filter over the whole frame into dst.
+static void TMS9918_Filter(Uint8 *dst, int pitch)
+{
+	int i;
+
+	if (filterWorkers != filterBands)
+		TMS9918_StartFilterWorkers();
+	filterDst = dst;
+	filterPitch = pitch;
+	for (i=1 ; i<filterBands ; i++)
+		SDL_SemPost(filterGo[i]);
+	TMS9918_FilterBand(0);
+	for (i=1 ; i<filterBands ; i++)
+		SDL_SemWait(filterDone);
+}
+
+static void TMS9918_BlitFrame() {
+	// This does the scaling and blitting. Only one thread may be in
+	// here at once; external callers go through TMS9918_Blit.
+	int i;
+	Uint8 *dst = (Uint8 *)screen->pixels;
+	int pitch = screen->pitch;
+#if __ALTIVEC__
+	vec_dstt(pixels, 16, 0);
+	vec_dststt(dst, ((64 << 24) | 64), 1);
+	vec_dststt(dst + pitch, ((64 << 24) | 64), 2);
 #endif
+
+	if ( SDL_MUSTLOCK(screen) ) SDL_LockSurface(screen);
+	if (UNLIKELY(screenFilter != FILTER_NONE))
+		TMS9918_Filter(dst, pitch);
+	else for (i=0; i<49152; i+=256) {
+		TMS9918_ConvertRow(&pixels[i], convertedRow);
+		scaleRow(convertedRow, dst, pitch);
+		dst += pitch * screenScale;
+	}
 #if __ALTIVEC__
 	vec_dssall();
+#elif __SSE2__
+	_mm_sfence();
 #endif
 	if ( SDL_MUSTLOCK(screen) ) SDL_UnlockSurface(screen);
-	TMS9918_Update();
+	SDL_Flip(screen);
+}
+
+// Hand the frame just presented to the capture thread.
+static void TMS9918_CaptureFrame(Uint64 micros) {
+	Uint8 palette[16][3];
+	int i;
+
+	for (i=0 ; i<16 ; i++) {
+		palette[i][0] = ColourTable[i].r;
+		palette[i][1] = ColourTable[i].g;
+		palette[i][2] = ColourTable[i].b;
+	}
+	Capture_Frame(pixels, palette, micros);
+}
+
+void TMS9918_Blit() {
+	TMS9918_Sync();
+	TMS9918_BlitFrame();
 }
 
 int TMS9918_Init()
 {
 	int x, y;
+
+	TMS9918_Sync();
+	presentedValid = 0;
 #if __APPLE__
 // SDL_HWSURFACE is noticeably faster even though it shouldn't be.
 #define VMFLAGS SDL_HWSURFACE
 #else
 #define VMFLAGS SDL_SWSURFACE
 #endif
-	screen = SDL_SetVideoMode ( 256 * SCREEN_X, 192 * SCREEN_X,
+	screen = SDL_SetVideoMode ( 256 * screenScale, 192 * screenScale,
 		 16, VMFLAGS );
 #if __ALTIVEC__
 	fprintf(stderr, "Altivec enabled; display=%08x; backing=%08x\n",
@@ -240,8 +1072,13 @@ int TMS9918_Init()
 	assert(!((uintptr_t)(screen->pixels) & 0x0f) && 
 		!((uintptr_t)(pixels) & 0x0f));
 #endif
+	TMS9918_SelectScaler();
 	skipupdate = 0;
 
+	TMS9918_MapColours();
+	TMS9918_FlushTileCache();
+	TMS9918_MakeSpanMasks();
+
 	for (x=0 ; x<256 ; x++)
 		for (y=0 ; y<192 ; y++)
 			TMS9918_DrawPixel(x, y, TI_LIGHT_BLUE);
@@ -253,10 +1090,40 @@ int TMS9918_Init()
 		VDP_Registers.Registers[y] = 0x0000;	
 
 	memset(VDP_MemoryMap, 0xF0, 16384);
+	memset(spritePatternDirty, 0xFF, sizeof(spritePatternDirty));
+	TMS9918_ClassifyVRAM();
 
 	return 0;
 }
 
+static void TMS9918_MarkRegion(int base, int length, Uint8 region)
+{
+	int i;
+
+	for (i=base; i<base+length && i<16384; i++)
+		vramRegion[i] |= region;
+}
+
+/* Rebuild the region map from the table base registers. Only the base
+   address bits are honoured; the mode 2 table masks in the low bits of
+   R3 and R4 are assumed to be all ones, as the Tomy OS sets them. */
+static void TMS9918_ClassifyVRAM()
+{
+	TWORD *r = VDP_Registers.Registers;
+
+	memset(vramRegion, 0, 16384);
+	TMS9918_MarkRegion((r[2] & 0x0F) << 10, 768, VRAM_NAME);
+	if (r[0] & 0x02) {
+		TMS9918_MarkRegion((r[4] & 0x04) << 11, 0x1800, VRAM_PATTERN);
+		TMS9918_MarkRegion((r[3] & 0x80) << 6, 0x1800, VRAM_COLOUR);
+	} else {
+		TMS9918_MarkRegion((r[4] & 0x07) << 11, 2048, VRAM_PATTERN);
+		TMS9918_MarkRegion(r[3] << 6, 32, VRAM_COLOUR);
+	}
+	TMS9918_MarkRegion((r[5] & 0x7F) << 7, 128, VRAM_SPRITE_ATTR);
+	TMS9918_MarkRegion((r[6] & 0x07) << 11, 2048, VRAM_SPRITE_PATTERN);
+}
+
 void TMS9918_WriteToVDPRegister(TBYTE byte)
 {	static TBYTE lastcommand;
 
@@ -281,7 +1148,12 @@ void TMS9918_WriteToVDPRegister(TBYTE byte)
 		return;
 	case 0x80:
 		writeMode = WM_NOTSTARTED;
-		VDP_Registers.Registers[byte & 0x07] = lastByte;
+		if (VDP_Registers.Registers[byte & 0x07] != lastByte) {
+			VDP_Registers.Registers[byte & 0x07] = lastByte;
+			// R1 and R7 don't move any tables.
+			if ((byte & 0x07) != 1 && (byte & 0x07) != 7)
+				TMS9918_ClassifyVRAM();
+		}
 		return;
 	}
 
@@ -293,13 +1165,12 @@ void TMS9918_WriteToVDPRegister(TBYTE byte)
 
 inline void TMS9918_WriteToVDPData(TBYTE byte)
 {
-	// Only some kinds of writes require forcing an update.
-	if (VDP_Registers.Registers[0] & 0x02) {
-		// GRAPHIC mode. Writes above 0x3800 do not need an update.
-		if (LIKELY(VDP_Registers.MP < 0x3800)) skipupdate = 0;
-	} else {
-		// BASIC mode. Writes above 0x0820 do not need an update.
-		if (VDP_Registers.MP < 0x0820) skipupdate = 0;
+	// Only writes to tables in use require forcing an update.
+	if (vramRegion[VDP_Registers.MP & 0x3FFF]) {
+		skipupdate = 0;
+		if (UNLIKELY(vramRegion[VDP_Registers.MP & 0x3FFF] &
+				VRAM_SPRITE_PATTERN))
+			TMS9918_MarkSpritePattern(VDP_Registers.MP & 0x3FFF);
 	}
 /*
 if (VDP_Registers.MP == 0x30a1 && byte == 0x80) {
@@ -308,7 +1179,29 @@ gDebugger.breakpointHit = 1;
 }
 */
 	
-	VDP_MemoryMap[VDP_Registers.MP++] = byte; //memoryMap[0xE000];
+	VDP_MemoryMap[VDP_Registers.MP++ & 0x3FFF] = byte; //memoryMap[0xE000];
+}
+
+// A run of data port writes, as one copy.
+void TMS9918_WriteBlockToVDPData(TBYTE *data, int length)
+{
+	int address, run, i;
+
+	while (length > 0) {
+		address = VDP_Registers.MP & 0x3FFF;
+		run = 16384 - address;
+		if (run > length) run = length;
+		for (i=address; i<address+run; i++) {
+			if (!vramRegion[i]) continue;
+			skipupdate = 0;
+			if (vramRegion[i] & VRAM_SPRITE_PATTERN)
+				TMS9918_MarkSpritePattern(i);
+		}
+		memcpy(VDP_MemoryMap + address, data, run);
+		VDP_Registers.MP += run;
+		data += run;
+		length -= run;
+	}
 }
 
 inline TBYTE TMS9918_ReadFromVDPData()
@@ -318,13 +1211,28 @@ inline TBYTE TMS9918_ReadFromVDPData()
 
 inline TBYTE TMS9918_ReadStatusRegister()
 {
-	TBYTE OldST = VDP_Registers.ST;
+	TBYTE status;
+
+	// Pick up sprite flags from the renderer.
+	if (renderThread) SDL_LockMutex(renderLock);
+	if ((pendingStatus & VDP_ST_FLAG_S5) &&
+			!(VDP_Registers.ST & VDP_ST_FLAG_S5))
+		VDP_Registers.ST = (VDP_Registers.ST & 0xA0) | pendingStatus;
+	else
+		VDP_Registers.ST |= pendingStatus & VDP_ST_FLAG_C;
+	pendingStatus = 0;
+	if (renderThread) SDL_UnlockMutex(renderLock);
+
 	VDP_Registers.ST |= VDP_ST_FLAG_F;
-	return VDP_Registers.ST;
+	status = VDP_Registers.ST;
+	// Reading clears the sprite flags.
+	VDP_Registers.ST &= ~(VDP_ST_FLAG_S5 | VDP_ST_FLAG_C);
+	return status;
 }
 
 inline void TMS9918_Update() 
 {
+	TMS9918_Sync();
 	SDL_Flip(screen);
 }
 
@@ -334,6 +1242,9 @@ void TMS9918_PrintDebugFont(int x, int y, char letter)
 	FontCharacter *source;
 	int pixelX, pixelY;
 
+	TMS9918_Sync();
+	presentedValid = 0;
+
 	if (letter > '(')
 		source = &DebugFont[letter-'('];
 	else
@@ -349,137 +1260,131 @@ void TMS9918_PrintDebugFont(int x, int y, char letter)
 
 inline void TMS9918_DrawPixel(int x, int y, int PaletteEntry)
 {
-	Uint32 color = SDL_MapRGB(screen->format, ColourTable[PaletteEntry].r, ColourTable[PaletteEntry].g, ColourTable[PaletteEntry].b);
-	/* assume pitch is 512 */
-	Uint16 *bufp = (Uint16 *)pixels + (y << 8) + x;
-	*bufp = color;
+	pixels[(y << 8) + x] = PaletteEntry;
 }
-inline void TMS9918_Draw8Pixels(SDL_Surface *screen, int x, int y,
-	int PaletteEntry)
+
+void TMS9918_FlushTileCache()
+{
+	memset(tileCache, 0, sizeof(tileCache));
+	tileCacheClock = 0;
+}
+
+int TMS9918_TileCacheHitRate()
 {
-	Uint32 color = SDL_MapRGB(screen->format, ColourTable[PaletteEntry].r, ColourTable[PaletteEntry].g, ColourTable[PaletteEntry].b);
-	/* assume pitch is 512, assume chunky video */
-	Uint16 *bufp = (Uint16 *)pixels + (y << 8) + x;
-	*bufp++=color;
-	*bufp++=color;
-	*bufp++=color;
-	*bufp++=color;
-	*bufp++=color;
-	*bufp++=color;
-	*bufp++=color;
-	*bufp++=color;
+	Uint32 total = tileCacheHits + tileCacheMisses;
+
+	if (!total) return 0;
+	return (int)(((double)tileCacheHits * 100.0) / (double)total);
+}
+
+// Transparent foreground or background shows the backdrop colour.
+static inline TBYTE TMS9918_ResolveColour(TBYTE paletteIndex)
+{
+	if ((paletteIndex & 0x0F) == 0x00)
+		paletteIndex = (paletteIndex & 0xF0) + (renderRegisters->Registers[7] & 0x0F);
+	if ((paletteIndex & 0xF0) == 0x00)
+		paletteIndex = (paletteIndex & 0x0F) + ((renderRegisters->Registers[7] & 0x0F) << 4);
+	return paletteIndex;
+}
+
+// Find the decoded block for this key, decoding it into the least
+// recently used way of its set if it isn't there.
+static Uint8 *TMS9918_LookupTile(TileKey *key)
+{
+	Uint32 hash;
+	TileCacheEntry *set, *victim;
+	Uint8 *block;
+	int w, x, y;
+
+	hash = key->w[0] ^ (key->w[1] * 0x9E3779B1) ^
+		(key->w[2] * 0x85EBCA77) ^ (key->w[3] * 0xC2B2AE3D);
+	set = tileCache[(hash ^ (hash >> 15) ^ (hash >> 24)) & (TC_SETS-1)];
+
+	if (UNLIKELY(!++tileCacheClock)) {
+		// The clock wrapped. Start over rather than confuse LRU.
+		TMS9918_FlushTileCache();
+		tileCacheClock = 1;
+	}
+
+	victim = set;
+	for (w=0; w<TC_WAYS; w++) {
+		if (set[w].stamp &&
+			set[w].key.w[0] == key->w[0] &&
+			set[w].key.w[1] == key->w[1] &&
+			set[w].key.w[2] == key->w[2] &&
+			set[w].key.w[3] == key->w[3]) {
+			set[w].stamp = tileCacheClock;
+			tileCacheHits++;
+			return set[w].block;
+		}
+		if (set[w].stamp < victim->stamp)
+			victim = &set[w];
+	}
+
+	tileCacheMisses++;
+	victim->key = *key;
+	victim->stamp = tileCacheClock;
+	block = victim->block;
+	for (y=0; y<8; y++) {
+		TBYTE mask = key->b[y];
+		Uint8 fg = key->b[y+8] >> 4;
+		Uint8 bg = key->b[y+8] & 0x0F;
+
+		for (x=0; x<8; x++) {
+			*block++ = (mask & 0x80) ? fg : bg;
+			mask <<= 1;
+		}
+	}
+	return victim->block;
+}
+
+// Copy a decoded block to its cell. Each row is 8 bytes.
+static inline void TMS9918_PutTile(int cx8, int cy8, Uint8 *block)
+{
+	Uint8 *bufp = pixels + (cy8 << 8) + cx8;
+	int y;
+
+	for (y=0; y<8; y++) {
+		memcpy(bufp, block, 8);
+		bufp += 256;
+		block += 8;
+	}
 }
 
 /* Drawing the screen is in two separate routines.
    The Tutor is in mode 2 for the title screen, MENU and GRAPHIC.
    For BASIC, it's mode 0. */
 
-#define DPX TMS9918_DrawPixel(cx8+x, cy8, (VDP_MemoryMap[ch8] & mask)?spalette1:spalette0);x++;mask>>=1;
 void TMS9918_DrawCharacter_Mode0(int cx, int cy, TBYTE character)
 {
-	int x, y;
-	TBYTE mask;
+	TileKey key;
 	TBYTE paletteIndex;
-	TBYTE spalette0;
-	TBYTE spalette1;
-	int characterOffset = 0;
-	int cx8 = cx << 3;
-	int cy8 = cy << 3;
-	int ch8 = character << 3;
+	int ch8 = (character << 3) + ((renderRegisters->Registers[4]) << 11);
 
-	characterOffset = (VDP_Registers.Registers[4]) << 11;
+	// Mode 0. Compute palette once for the whole cell.
+	paletteIndex = TMS9918_ResolveColour(
+		renderVRAM[(renderRegisters->Registers[3]<<6)+(character>>3)]);
 
-	// Mode 0. Compute palette once.
-	paletteIndex = VDP_MemoryMap[(VDP_Registers.Registers[3]<<6)+(character>>3)];
-	if ((paletteIndex & 0x0F) == 0x00)
-		paletteIndex = (paletteIndex & 0xF0) + (VDP_Registers.Registers[7] & 0x0F);
-	if ((paletteIndex & 0xF0) == 0x00)
-		paletteIndex = (paletteIndex & 0x0F) + ((VDP_Registers.Registers[7] & 0x0F) << 4);
-
-	ch8 += characterOffset;
-	spalette1 = paletteIndex >> 4;
-	spalette0 = paletteIndex & 0x0F;
-	for (y=0 ; y<8 ; y++)
-	{
-		x = 0;
-		/* Empirically hit most. */
-		if (LIKELY(VDP_MemoryMap[ch8] == 0x00)) {
-			TMS9918_Draw8Pixels(screen, cx8, cy8,
-				spalette0);
-		} else
-		if (VDP_MemoryMap[ch8] == 0xFF) {
-			TMS9918_Draw8Pixels(screen, cx8, cy8,
-				spalette1);
-		} else {
-			mask = 0x80;
-DPX
-DPX
-DPX
-DPX
-DPX
-DPX
-DPX
-DPX
-		}
-		ch8++;
-		cy8++;
-	}
+	memcpy(key.b, renderVRAM + ch8, 8);
+	memset(key.b + 8, paletteIndex, 8);
+	TMS9918_PutTile(cx << 3, cy << 3, TMS9918_LookupTile(&key));
 }
 
 void TMS9918_DrawCharacter_Mode2(int cx, int cy, TBYTE character)
 {
-	int x, y;
-	TBYTE mask;
-	TBYTE paletteIndex;
-	TBYTE spalette0;
-	TBYTE spalette1;
-	int characterOffset = 0;
-	int cx8 = cx << 3;
-	int cy8 = cy << 3;
-	int ch8 = character << 3;
-
-	characterOffset = (cy & 0xfff8) << 8;
-
-	// Mode 2
-	// Palette index can change on every line.
-	ch8 += characterOffset;
-	characterOffset += (int)character << 3;
+	TileKey key;
+	int y;
+	int characterOffset = ((cy & 0xfff8) << 8) + ((int)character << 3);
+	TBYTE *colours = renderVRAM + characterOffset +
+		((renderRegisters->Registers[3] & 0x80) << 6);
+
+	// Mode 2. Palette index can change on every line.
+	memcpy(key.b, renderVRAM + characterOffset +
+		((renderRegisters->Registers[4] & 0x04) << 11), 8);
 	for (y=0 ; y<8 ; y++)
-	{
-		paletteIndex = VDP_MemoryMap[0x2000 + characterOffset + y];
-		if ((paletteIndex & 0x0F) == 0x00)
-			paletteIndex = (paletteIndex & 0xF0) + (VDP_Registers.Registers[7] & 0x0F);
-		if ((paletteIndex & 0xF0) == 0x00)
-			paletteIndex = (paletteIndex & 0x0F) + ((VDP_Registers.Registers[7] & 0x0F) << 4);
-
-		spalette1 = paletteIndex >> 4;
-		spalette0 = paletteIndex & 0x0F;
-		x = 0;
-		/* Empirically hit most. */
-		if (LIKELY(VDP_MemoryMap[ch8] == 0x00 ||
-			spalette1 == spalette0)) {
-			TMS9918_Draw8Pixels(screen, cx8, cy8,
-				spalette0);
-		} else
-		if (VDP_MemoryMap[ch8] == 0xFF) {
-			TMS9918_Draw8Pixels(screen, cx8, cy8,
-				spalette1);
-		} else {
-			mask = 0x80;
-DPX
-DPX
-DPX
-DPX
-DPX
-DPX
-DPX
-DPX
-		}
-		ch8++;
-		cy8++;
-	}
+		key.b[y+8] = TMS9918_ResolveColour(colours[y]);
+	TMS9918_PutTile(cx << 3, cy << 3, TMS9918_LookupTile(&key));
 }
-#undef DPX
 
 /*
  * The 9918 sprite system can best be considered a series of planes, with
@@ -502,26 +1407,165 @@ DPX
  * sizing attributes.
  */
 
+/* Sprite rows, pre-expanded to pixel masks (MSB leftmost, 8 to 32 wide
+   depending on size and magnification), by pattern number. The whole
+   cache belongs to one R1 size/magnification and R6 setting. */
+static Uint32 spriteRows[256][16];
+static Uint32 spriteRowsValid[8];
+static int spriteRowsConfig = -1;
+static Uint32 spanMask[256][2];
+
+static inline Uint32 TMS9918_Magnify(Uint32 v);
+
+// Apply pattern writes the emulator saw since the last frame.
+static void TMS9918_UpdateSpriteRows()
+{
+	int config = (renderRegisters->Registers[6] & 0x07) |
+		((renderRegisters->Registers[1] & 0x03) << 3), i;
+
+	if (config != spriteRowsConfig) {
+		spriteRowsConfig = config;
+		memset(spriteRowsValid, 0, sizeof(spriteRowsValid));
+	}
+	for (i=0; i<8; i++) {
+		spriteRowsValid[i] &= ~renderSpriteDirty[i];
+		// A 16x16 sprite is cached under its first pattern.
+		spriteRowsValid[i] &= ~((renderSpriteDirty[i] & 0x22222222) >> 1 |
+			(renderSpriteDirty[i] & 0x44444444) >> 2 |
+			(renderSpriteDirty[i] & 0x88888888) >> 3);
+		renderSpriteDirty[i] = 0;
+	}
+}
+
+static Uint32 *TMS9918_SpriteRows(int id, int size, int magnify)
+{
+	TBYTE *pattern;
+	Uint32 bits;
+	int y;
+
+	if (size == 16) id &= 0xFC;
+	if (LIKELY(spriteRowsValid[id >> 5] & (1U << (id & 31))))
+		return spriteRows[id];
+
+	pattern = renderVRAM + ((renderRegisters->Registers[6] & 0x07) << 11) +
+		(id << 3);
+	for (y=0; y<size; y++) {
+		bits = pattern[y] << 8;
+		if (size == 16) bits |= pattern[y + 16];
+		spriteRows[id][y] = magnify ? TMS9918_Magnify(bits) : bits << 16;
+	}
+	spriteRowsValid[id >> 5] |= 1U << (id & 31);
+	return spriteRows[id];
+}
+
+/* Write one sprite row into the backing buffer at x, stopping at end,
+   eight pixels at a time. */
+static inline void TMS9918_SpriteSpan(Uint8 *row, int x, Uint32 bits,
+	int end, TBYTE paletteIndex)
+{
+	Uint32 fill = paletteIndex * 0x01010101U, word[2];
+	int b;
+
+	if (x >= end) return;
+	if (end - x < 32)
+		bits &= ~(0xFFFFFFFFU >> (end - x));
+	row += x;
+	while (bits) {
+		b = bits >> 24;
+		if (b) {
+			memcpy(word, row, 8);
+			word[0] = (word[0] & ~spanMask[b][0]) | (fill & spanMask[b][0]);
+			word[1] = (word[1] & ~spanMask[b][1]) | (fill & spanMask[b][1]);
+			memcpy(row, word, 8);
+		}
+		bits <<= 8;
+		row += 8;
+	}
+}
+
+static void TMS9918_MakeSpanMasks()
+{
+	int b, i;
+
+	for (b=0; b<256; b++)
+		for (i=0; i<8; i++)
+			((Uint8 *)spanMask[b])[i] = (b & (0x80 >> i)) ? 0xFF : 0;
+}
+
+// Spread each bit of a 16-pixel sprite row over two pixels.
+static inline Uint32 TMS9918_Magnify(Uint32 v)
+{
+	v = (v | (v << 8)) & 0x00FF00FF;
+	v = (v | (v << 4)) & 0x0F0F0F0F;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v | (v << 1);
+}
+
+/* OR a sprite row (MSB leftmost) into the 256-bit coverage mask for this
+   scanline at pixel x, returning non-zero if it hit anything already
+   there. */
+static inline Uint32 TMS9918_CoverLine(Uint32 *coverage, Uint32 bits, int x)
+{
+	Uint32 lo, hi = 0, hit;
+	int w;
+
+	if (x < 0) {
+		if (x <= -32) return 0;
+		bits <<= -x;
+		x = 0;
+	}
+	w = x >> 5;
+	lo = bits >> (x & 31);
+	if (x & 31) hi = bits << (32 - (x & 31));
+	hit = coverage[w] & lo;
+	coverage[w] |= lo;
+	if (w < 7) {
+		hit |= coverage[w+1] & hi;
+		coverage[w+1] |= hi;
+	}
+	return hit;
+}
+
+// Post this frame's S5/C/fifth sprite status, or the last one if < 0.
+static void TMS9918_PostSpriteStatus(int status)
+{
+	if (renderThread) SDL_LockMutex(renderLock);
+	if (status >= 0)
+		spriteStatus = status;
+	if ((spriteStatus & VDP_ST_FLAG_S5) && !(pendingStatus & VDP_ST_FLAG_S5))
+		pendingStatus = (pendingStatus & VDP_ST_FLAG_C) | spriteStatus;
+	else
+		pendingStatus |= spriteStatus & VDP_ST_FLAG_C;
+	if (renderThread) SDL_UnlockMutex(renderLock);
+}
+
 void TMS9918_DrawSprites()
 {
 	TMS9918_SpriteData *currentSprite;
-	TBYTE *spriteGraphic, *spriteLine, paletteIndex, mask;
-	int spriteNumber=31, x, y, s, leftBorder=0;
+	TBYTE paletteIndex;
+	int y, s, leftBorder=0;
 	TBYTE cx, cy;
-	TWORD ccx; // Has to handle > 256
-	int scale, scalebit, size, extent, current;
+	int scale, scalebit, size, extent, current, line;
 	TMS9918_SpriteData *displayList[4];
 	int displayLine[4];
-	uintptr_t baseAddress = (uintptr_t)VDP_MemoryMap+(VDP_Registers.Registers[5] << 7);
+	uintptr_t baseAddress = (uintptr_t)renderVRAM+(renderRegisters->Registers[5] << 7);
+	Uint32 coverage[8], bits;
+	TBYTE status = 0;
+
+	TMS9918_UpdateSpriteRows();
 
 	// Optimization: if the first sprite's Y position is 209, we can
 	// just abort, as we will never render sprites on any line.
 	currentSprite = (TMS9918_SpriteData *)(baseAddress);
-	if (((currentSprite->y+1) & 0xff) == 209) return;
+	if (((currentSprite->y+1) & 0xff) == 209) {
+		TMS9918_PostSpriteStatus(0);
+		return;
+	}
 
-	scalebit = (VDP_Registers.Registers[1] & 0x01);
+	scalebit = (renderRegisters->Registers[1] & 0x01);
 	scale = scalebit + 1;
-	size = (((VDP_Registers.Registers[1] & 0x02) >> 1) << 3) + 8;
+	size = (((renderRegisters->Registers[1] & 0x02) >> 1) << 3) + 8;
 
 	// Display list sprite algorithm.
 
@@ -559,7 +1603,7 @@ void TMS9918_DrawSprites()
 				if (y >= (cy + extent))
 					continue; // sprite shown already
 				// This line should be displayed. Set it.
-				displayLine[current] = (y - cy) >> scalebit;
+				line = (y - cy) >> scalebit;
 			} else {
 				// Sprite is under the top border somewhere.
 				// The number of lines visible is |extent|
@@ -571,77 +1615,59 @@ void TMS9918_DrawSprites()
 				if (y >= vlines)
 					continue; // sprite shown already
 				// This line should be displayed. Set it.
-				displayLine[current] = (y + (extent - vlines))
-					>> scalebit;
+				line = (y + (extent - vlines)) >> scalebit;
+			}
+
+			// A fifth sprite on the line isn't drawn, but the
+			// first one found in a frame goes in the status
+			// register along with S5.
+			if (current == 4) {
+				status |= VDP_ST_FLAG_S5 | (s >> 2);
+				break;
 			}
 
 			// Add the sprite struct to the display list.
 			displayList[current] = currentSprite;
+			displayLine[current] = line;
 			current++;
 
-			// If we have all our slots filled, stop, else loop.
-			if (current == 4) break;
-
-			// TODO: The VDP sets its status register to
-			// itself & >E0 | the first "dropped" sprite. This
-			// means we need to continue the search and is
-			// somewhat unnecessary as the Tomy OS does not
-			// expose this register to programs, so let's not
-			// do it yet.
+			// If we have all our slots filled, stop unless we
+			// still need to look for a fifth, else loop.
+			if (current == 4 && (status & VDP_ST_FLAG_S5)) break;
 		}
 
 		// Draw the lines back to front, unless no sprites found.
 		if (current) {
+			memset(coverage, 0, sizeof(coverage));
 			current--;
 			for(s=current; s>=0; s--) {
 				currentSprite = displayList[s];
 				if (!currentSprite) continue; // paranoia
 
+				bits = TMS9918_SpriteRows(currentSprite->id,
+					size, scalebit)[displayLine[s]];
+
+				// Collisions count transparent sprites too.
+				if (!(status & VDP_ST_FLAG_C)) {
+					if (TMS9918_CoverLine(coverage, bits,
+						currentSprite->x -
+						((currentSprite->colour & 0x80) ? 32 : 0)))
+						status |= VDP_ST_FLAG_C;
+				}
+
 				paletteIndex = (currentSprite->colour & 0x0F);
 				if (!paletteIndex) continue;
-
-				spriteGraphic =
-(TBYTE *)(VDP_MemoryMap+(VDP_Registers.Registers[6] << 11)+((currentSprite->id)<<3));
-				spriteLine = (TBYTE *)(spriteGraphic + displayLine[s]);
 				cx = currentSprite->x;
-				cy = currentSprite->y+1;
 				if (currentSprite->colour & 0x80) { // Check early clock.
 					cx -= 32;
 					leftBorder = 1;
 				}
-				ccx = cx;
-				mask = 0x80;
-				if (UNLIKELY(scale == 1)) { // The Tomy OS only uses this in the menu.
-					for (x=0 ; x<size ; x++) {
-						if (ccx >= 256)
-							break;
-						if (UNLIKELY(leftBorder))
-							if (ccx >= 0xD0) break;
-						if ((*(spriteLine+(x>>3)*0x10)) & mask) {
-							TMS9918_DrawPixel(ccx, y, paletteIndex);
-						}
-						mask >>= 1;
-						if (!mask) mask = 0x80;
-						ccx++;
-					}
-				} else {
-					for (x=0 ; x<size ; x++) {
-						if (ccx >= 256)
-							break;
-						if (UNLIKELY(leftBorder))
-						 	if (ccx >= 0xD0) break;
-						if ((*(spriteLine+(x>>3)*0x10)) & mask) {
-							TMS9918_DrawPixel(ccx, y, paletteIndex);
-							TMS9918_DrawPixel(ccx+1, y, paletteIndex);
-						}
-						mask >>= 1;
-						if (!mask) mask = 0x80;
-						ccx += 2;
-					}
-				}
+				TMS9918_SpriteSpan(pixels + (y << 8), cx, bits,
+					leftBorder ? 0xD0 : 256, paletteIndex);
 			}
 		}
 	}
+	TMS9918_PostSpriteStatus(status);
 }
 
 /* Put the redraw routines into separate ones so that we only have to test once. */
@@ -731,46 +1757,38 @@ D32
 void TMS9918_Force_Redraw()
 {
 	skipupdate = 0;
+	presentedValid = 0;
 	TMS9918_Redraw();
 }
 
-void TMS9918_Redraw()
+/* VRAM and the registers were replaced wholesale, as by loading a
+   snapshot, so rebuild what was worked out from them and redraw. */
+void TMS9918_Reload()
+{
+	TMS9918_ClassifyVRAM();
+	memset(spritePatternDirty, 0xFF, sizeof(spritePatternDirty));
+	TMS9918_Force_Redraw();
+}
+
+// Draw the VDP state the render pointers refer to into the backing buffer.
+static void TMS9918_Rasterize()
 {
 	int currentCharacter=0;
 	TBYTE *characterPointer;
 	
-	if (skipupdate)
-		return;
-	
-	if (UNLIKELY(!(VDP_Registers.Registers[1] & 0x40)))
+	if (UNLIKELY(!(renderRegisters->Registers[1] & 0x40)))
 	{
 		// Blank screen, backdrop colour, no sprites.
-		int PaletteEntry = VDP_Registers.Registers[7] & 0x0F;
-		Uint16 color = SDL_MapRGB(screen->format, ColourTable[PaletteEntry].r, ColourTable[PaletteEntry].g, ColourTable[PaletteEntry].b);
-		Uint16 *bufp = pixels;
-		int i;
-
-#if __ALTIVEC__
-		// Splat a vector and blast it on. (More efficient would
-		// be to do it right to the display, but this isn't heavily
-		// hit.)
-		// Can't use vec_splat_u16 because the colour is usually
-		// out of range.
-		vector unsigned short colourv = {
-			color, color, color, color,
-			color, color, color, color };
-		for(i=0; i<49152*2; i+=16) { vec_st(colourv, i, bufp); }
-#else
-		// A simple memset() won't do here.
-		for(i=0; i<49152; i++) { *bufp++ = color; }
-#endif
-		TMS9918_Blit();
-		skipupdate = 1;
+		memset(pixels, renderRegisters->Registers[7] & 0x0F, 49152);
+		// Patterns are usually loaded while blanked, and the dirty
+		// bits for them are only handed over once.
+		TMS9918_UpdateSpriteRows();
+		TMS9918_PostSpriteStatus(0);
 		return;
 	}
 
-	characterPointer = VDP_MemoryMap+(VDP_Registers.Registers[2] << 10);
-	if (VDP_Registers.Registers[0] & 0x02) {
+	characterPointer = renderVRAM+(renderRegisters->Registers[2] << 10);
+	if (renderRegisters->Registers[0] & 0x02) {
 #define ROW TMS9918_Redraw_Row_Mode2(characterPointer, currentCharacter);\
 		characterPointer += 32;\
 		currentCharacter += 32;
@@ -832,7 +1850,216 @@ ROW
 	}
 
 	TMS9918_DrawSprites();
-	TMS9918_Blit();
+}
+
+static int TMS9918_RenderThread(void *unused)
+{
+	int slot;
+	Uint64 start;
+	long micros;
+
+	SDL_LockMutex(renderLock);
+	for(;;) {
+		while (pendingSnapshot < 0 && !renderQuit)
+			SDL_CondWait(renderWake, renderLock);
+		if (renderQuit) break;
+		slot = pendingSnapshot;
+		pendingSnapshot = -1;
+		renderingSnapshot = slot;
+		SDL_UnlockMutex(renderLock);
+
+		renderVRAM = snapshots[slot].VRAM;
+		renderRegisters = &snapshots[slot].Registers;
+		renderSpriteDirty = snapshots[slot].SpriteDirty;
+		start = Timing_Now();
+		TMS9918_Rasterize();
+		TMS9918_BlitFrame();
+		micros = (long)((Timing_Now() - start) / 1000);
+		if (UNLIKELY(Capture_Active()))
+			TMS9918_CaptureFrame(snapshots[slot].micros);
+
+		SDL_LockMutex(renderLock);
+		presentCount++;
+		presentMicros += micros;
+		renderingSnapshot = -1;
+		SDL_CondBroadcast(renderIdle);
+	}
+	SDL_UnlockMutex(renderLock);
+	return 0;
+}
+
+void TMS9918_StartRenderThread()
+{
+	if (renderThread) return;
+	renderLock = SDL_CreateMutex();
+	renderWake = SDL_CreateCond();
+	renderIdle = SDL_CreateCond();
+	renderQuit = 0;
+	pendingSnapshot = renderingSnapshot = -1;
+	renderThread = SDL_CreateThread(TMS9918_RenderThread, NULL);
+	if (!renderThread)
+		fprintf(stderr, "Couldn't start render thread: %s\n",
+			SDL_GetError());
+}
+
+void TMS9918_StopRenderThread()
+{
+	if (!renderThread) return;
+	TMS9918_Sync();
+	SDL_LockMutex(renderLock);
+	renderQuit = 1;
+	SDL_CondSignal(renderWake);
+	SDL_UnlockMutex(renderLock);
+	SDL_WaitThread(renderThread, NULL);
+	renderThread = NULL;
+	renderVRAM = VDP_MemoryMap;
+	renderRegisters = &VDP_Registers;
+	renderSpriteDirty = spritePatternDirty;
+}
+
+/* Wait for the render thread to finish with the backing buffer and the
+   display. Anything else that touches them must call this first. */
+void TMS9918_Sync()
+{
+	if (!renderThread) return;
+	SDL_LockMutex(renderLock);
+	while (pendingSnapshot >= 0 || renderingSnapshot >= 0)
+		SDL_CondWait(renderIdle, renderLock);
+	SDL_UnlockMutex(renderLock);
+}
+
+/* xxHash64-style hash of VRAM and the control registers: four independent
+   lanes over 64-bit words, then folded together. */
+#define HASH_PRIME1	((Uint64)0x9E3779B185EBCA87ULL)
+#define HASH_PRIME2	((Uint64)0xC2B2AE3D27D4EB4FULL)
+#define HASH_ROUND(acc, v)	acc += (v) * HASH_PRIME2; \
+				acc = (acc << 31) | (acc >> 33); \
+				acc *= HASH_PRIME1;
+
+static Uint64 TMS9918_FrameHash()
+{
+	Uint64 a = HASH_PRIME1 + HASH_PRIME2, b = HASH_PRIME2, c = 0,
+		d = (Uint64)0 - HASH_PRIME1, h, v;
+	Uint64 word[4];
+	int i;
+
+	for (i=0; i<16384; i+=32) {
+		memcpy(word, VDP_MemoryMap + i, 32);
+		HASH_ROUND(a, word[0]);
+		HASH_ROUND(b, word[1]);
+		HASH_ROUND(c, word[2]);
+		HASH_ROUND(d, word[3]);
+	}
+	h = ((a << 1) | (a >> 63)) + ((b << 7) | (b >> 57)) +
+		((c << 12) | (c >> 52)) + ((d << 18) | (d >> 46));
+	for (i=0; i<8; i++) {
+		v = 0;
+		HASH_ROUND(v, (Uint64)(VDP_Registers.Registers[i] & 0xFF));
+		h ^= v;
+		h = ((h << 27) | (h >> 37)) * HASH_PRIME1;
+	}
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	return h;
+}
+
+unsigned long TMS9918_ElidedFrames()
+{
+	return elidedFrames;
+}
+
+// Hand the current VDP state to the render thread.
+static void TMS9918_QueueFrame()
+{
+	int slot, i;
+
+	SDL_LockMutex(renderLock);
+	// Replace a snapshot not yet picked up, else use the free one.
+	slot = (pendingSnapshot >= 0) ? pendingSnapshot :
+		(renderingSnapshot == 0) ? 1 : 0;
+	memcpy(snapshots[slot].VRAM, VDP_MemoryMap, 16384);
+	snapshots[slot].Registers = VDP_Registers;
+	snapshots[slot].micros = Capture_Time();
+	// A replaced snapshot's pattern writes still have to be applied.
+	for (i=0; i<8; i++) {
+		if (slot == pendingSnapshot)
+			snapshots[slot].SpriteDirty[i] |= spritePatternDirty[i];
+		else
+			snapshots[slot].SpriteDirty[i] = spritePatternDirty[i];
+		spritePatternDirty[i] = 0;
+	}
+	pendingSnapshot = slot;
+	SDL_CondSignal(renderWake);
+	SDL_UnlockMutex(renderLock);
+}
+
+/* The picture didn't change this frame, so a capture repeats the last
+   one. Wait for the render thread so the repeat lands after it. */
+static void TMS9918_CaptureRepeat()
+{
+	if (LIKELY(!Capture_Active()) || gDebugger.enabled)
+		return;
+	TMS9918_Sync();
+	Capture_Repeat(Capture_Time());
+}
+
+void TMS9918_Redraw()
+{
+	Uint64 hash, start;
+
+	// Nothing changed, but the VDP would still flag the same sprites.
+	if (skipupdate) {
+		TMS9918_PostSpriteStatus(-1);
+		TMS9918_CaptureRepeat();
+		return;
+	}
 	skipupdate = 1;
+
+	hash = TMS9918_FrameHash();
+	if (presentedValid && hash == presentedHash && !gDebugger.enabled) {
+		elidedFrames++;
+		TMS9918_PostSpriteStatus(-1);
+		TMS9918_CaptureRepeat();
+		return;
+	}
+	presentedHash = hash;
+	presentedValid = 1;
+
+	// The debugger draws over the backing buffer, so don't race it.
+	if (renderThread && !gDebugger.enabled) {
+		// A capture needs every frame in order, so don't let this one
+		// replace a frame still waiting for the render thread.
+		if (UNLIKELY(Capture_Active()))
+			TMS9918_Sync();
+		TMS9918_QueueFrame();
+		return;
+	}
+	TMS9918_Sync();
+	renderVRAM = VDP_MemoryMap;
+	renderRegisters = &VDP_Registers;
+	renderSpriteDirty = spritePatternDirty;
+	start = Timing_Now();
+	TMS9918_Rasterize();
+	TMS9918_BlitFrame();
+	presentMicros += (long)((Timing_Now() - start) / 1000);
+	presentCount++;
+	if (UNLIKELY(Capture_Active()) && !gDebugger.enabled)
+		TMS9918_CaptureFrame(Capture_Time());
+}
+
+/* How many frames were drawn and flipped since the last call, on either
+   thread, with the host time they took in all in *micros. */
+int TMS9918_PresentCost(long *micros)
+{
+	int count;
+
+	if (renderThread) SDL_LockMutex(renderLock);
+	count = presentCount;
+	*micros = presentMicros;
+	presentCount = 0;
+	presentMicros = 0;
+	if (renderThread) SDL_UnlockMutex(renderLock);
+	return count;
 }
 
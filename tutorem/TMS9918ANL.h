@@ -20,15 +20,27 @@ typedef struct Sprite_Struct
 #define VDP_ST_FLAG_S5	0x40
 #define VDP_ST_FLAG_C	0x20
 
+#define FILTER_NONE		0
+#define FILTER_SCANLINES	1
+#define FILTER_CRT		2
+#define FILTER_SMOOTH		3
+
 extern TMS9918_Type VDP_Registers;
 extern unsigned char VDP_MemoryMap[16384];
 
 int TMS9918_Init();
+void TMS9918_SetScale(int scale);
+void TMS9918_SetFilter(int filter, int threads);
+int TMS9918_FilterNamed(char *name);
+void TMS9918_Blit();
+void TMS9918_SetColour(int entry, int r, int g, int b);
+int TMS9918_LoadPalette(char *filename);
 
 void TMS9918_PrintDebugFont(int x, int y, char letter);
 inline void TMS9918_Update();
 void TMS9918_WriteToVDPRegister(TBYTE byte);
 void TMS9918_WriteToVDPData(TBYTE byte);
+void TMS9918_WriteBlockToVDPData(TBYTE *data, int length);
 TBYTE TMS9918_ReadFromVDPData();
 TBYTE TMS9918_ReadStatusRegister();
 
@@ -38,4 +50,12 @@ void TMS9918_DrawSprites();
 inline void TMS9918_Slock();
 inline void TMS9918_Sulock();
 void TMS9918_Force_Redraw();
+void TMS9918_Reload();
+void TMS9918_FlushTileCache();
+int TMS9918_TileCacheHitRate();
+unsigned long TMS9918_ElidedFrames();
+int TMS9918_PresentCost(long *micros);
 void TMS9918_Redraw();
+void TMS9918_StartRenderThread();
+void TMS9918_StopRenderThread();
+void TMS9918_Sync();
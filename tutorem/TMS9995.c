@@ -19,8 +19,10 @@ int extra = 0; // leftover cycles from Decrementer batching
 
 #include "TMS9995.h"
 #include "SN76489AN.h"
+#include "Audio.h"
 #include "TMS9918ANL.h"
 #include "Debugger.h"
+#include "Keyboard.h"
 
 #if defined(__clang__) || defined(__GNUC__)
 #  define LIKELY(x)   (__builtin_expect(!!(x), 1))
@@ -111,9 +113,9 @@ TWORD decrementerBase;
 
 unsigned char memoryMap[65536];
 extern int gCycle;
+extern int gRunTicks;
 extern int gPastewait;
 extern int runDebugEnabled;
-extern char gKeyboard[SDLK_LAST];
 int gDecrementerEnabled=0, gDecrementerMode=0, gBasicBreak=0, gHandlerBreak=0;
 
 inline TWORD SwitchEndianAlways(TWORD *thisWord)
@@ -351,6 +353,116 @@ inline int TMS9995_GetFlag(int flag)
 
 int SetAddress=0x0000;
 
+/* Streaming writes to the VDP data port. The Tomy OS fills VRAM with
+   loops of the form
+
+	[SWPB Rn]		(pacing for the VDP)
+	MOVB *Rs+,@>E000
+	[C   Rn,Rn]		(more pacing)
+	[INC Ri]		(a second counter)
+	DEC  Rc
+	JNE or JGT back to the top
+
+   Entered at the top with more than one iteration to go, we do all but
+   the last as one block write and charge the cycles they would have
+   taken. The last iteration is left to the interpreter so the status
+   bits come out right. We never run past the end of the slice or far
+   enough to fire the decrementer, so timing is exactly as interpreted. */
+#define VDP_STREAM_CYCLES	26	// MOVB 14, DEC 6, jump taken 6
+#define VDP_SWPB_CYCLES		26
+#define VDP_COMPARE_CYCLES	8
+#define VDP_INC_CYCLES		6
+#define VDP_STREAM_OVERLAPS(r) \
+	(source < CPU_Registers.WP + (r)*2 + 2 && \
+	 source + iterations > CPU_Registers.WP + (r)*2)
+
+static int TMS9995_VDPStreamLoop(TWORD instruction)
+{
+	TWORD pc = CPU_Registers.PC, source, count, op;
+	int swapReg = -1, incReg = -1, sourceReg, countReg;
+	int cost = VDP_STREAM_CYCLES, iterations, limit;
+
+	if ((instruction & 0xFFF0) == 0x06C0) {
+		swapReg = instruction & 0x0F;
+		cost += VDP_SWPB_CYCLES;
+		pc += 2;
+		instruction = TMS9995_FetchWord(pc);
+	}
+	if ((instruction & 0xFFF0) != 0xD830 ||
+			TMS9995_FetchWord(pc+2) != 0xE000)
+		return 0;
+	sourceReg = instruction & 0x0F;
+	pc += 4;
+
+	op = TMS9995_FetchWord(pc);
+	if ((op & 0xFC30) == 0x8000 && ((op >> 6) & 0x0F) == (op & 0x0F)) {
+		cost += VDP_COMPARE_CYCLES;
+		pc += 2;
+		op = TMS9995_FetchWord(pc);
+	}
+	if ((op & 0xFFF0) == 0x0580) {
+		incReg = op & 0x0F;
+		cost += VDP_INC_CYCLES;
+		pc += 2;
+		op = TMS9995_FetchWord(pc);
+	}
+	if ((op & 0xFFF0) != 0x0600)
+		return 0;
+	countReg = op & 0x0F;
+	op = TMS9995_FetchWord(pc+2);
+	if (((op & 0xFF00) != 0x1600 && (op & 0xFF00) != 0x1500) ||
+			(TWORD)(pc + 4 + 2*(int8_t)op) != CPU_Registers.PC)
+		return 0;
+	if (sourceReg == countReg || swapReg == sourceReg ||
+			swapReg == countReg || incReg == sourceReg ||
+			incReg == countReg || (incReg >= 0 && incReg == swapReg))
+		return 0;
+
+	count = TMS9995_GetRegister(countReg);
+	if ((op & 0xFF00) == 0x1500 && (int16_t)count <= 0)
+		return 0;
+	iterations = (count ? count : 65536) - 1;
+
+	// Stay inside this slice and short of the next decrementer tick.
+	limit = (gRunTicks - 1 - gCycle) / cost;
+	if (iterations > limit) iterations = limit;
+	if (decrementerBase) {
+		TWORD decrementer = *((TWORD *)(memoryMap+0xFFFA));
+		SwitchEndian(&decrementer);
+		limit = ((int)decrementer * 4 - extra - 1) / cost;
+		if (iterations > limit) iterations = limit;
+	}
+
+	// The source must be plain memory, not ports or a register the
+	// loop itself changes.
+	source = TMS9995_GetRegister(sourceReg);
+	if (iterations > 0x10000 - source)
+		iterations = 0x10000 - source;
+	if (iterations <= 0 ||
+			(source < 0xF000 && source + iterations > 0xC000) ||
+			VDP_STREAM_OVERLAPS(sourceReg) ||
+			VDP_STREAM_OVERLAPS(countReg) ||
+			(incReg >= 0 && VDP_STREAM_OVERLAPS(incReg)) ||
+			(swapReg >= 0 && VDP_STREAM_OVERLAPS(swapReg)))
+		return 0;
+
+	TMS9918_WriteBlockToVDPData(memoryMap + source, iterations);
+	memoryMap[0xE000] = memoryMap[source + iterations - 1];
+	TMS9995_SetRegister(sourceReg, source + iterations);
+	TMS9995_SetRegister(countReg, count - iterations);
+	if (incReg >= 0)
+		TMS9995_SetRegister(incReg,
+			TMS9995_GetRegister(incReg) + iterations);
+	if (swapReg >= 0 && (iterations & 1)) {
+		op = TMS9995_GetRegister(swapReg);
+		TMS9995_SetRegister(swapReg, (op << 8) | (op >> 8));
+	}
+
+	gCycle += iterations * cost;
+	TMS9995_DecDecrementer(iterations * cost);
+	return 1;
+}
+
 // External consumers call this routine. Only TMS9995.c calls Core.
 void TMS9995_ExecuteInstruction()
 {
@@ -388,6 +500,10 @@ void TMS9995_ExecuteInstruction()
 	}
 #undef i3
 #undef i4
+	if (((instruction & 0xFFF0) == 0xD830 ||
+			(instruction & 0xFFF0) == 0x06C0) &&
+			!gDebugger.enabled && TMS9995_VDPStreamLoop(instruction))
+		return;
 
 	// Traps. These are for areas that incomplete emulation does not
 	// fully cover. We would like to completely eliminate these because
@@ -572,7 +688,7 @@ inline void WriteTWord(TWORD *address, TWORD value)
 	}
 	if (shortAddress == 0xE200) {
 		/* Here for completeness, but the actual guts is WriteTByte. */
-		SN76489AN_WritePort(value);//memoryMap[0xE200]);
+		Audio_Write(value);//memoryMap[0xE200]);
 		return;
 	}
 	if (shortAddress == 0xEE40 || shortAddress == 0xEE60) {
@@ -672,7 +788,7 @@ void WriteTByte(TBYTE *address, TBYTE value)
 		return;
 	}
 	if (shortAddress == 0xE200) {
-		SN76489AN_WritePort(value); //memoryMap[0xE200]);
+		Audio_Write(value); //memoryMap[0xE200]);
 		return;
 	}
 }
@@ -809,170 +925,18 @@ int CLA_GetCRUBit(signed char displacement)
 TWORD CLA_GetCRUWord(int bits)
 {
 	TBYTE testvalue=0x00;
-	static TBYTE rotating=0x01;
-	static TWORD address = 0xEC60;
-	static TBYTE thisBit=0x10;
 
-	// It appears the keyboard is mapped into 8 sections.
-	// EC60 holds the enter key...
-
-	if (bits != 8)
-	{
-		int a= 1;
-	}
+	// It appears the keyboard is mapped into 8 sections, EC00 to EC70;
+	// EC60 holds the enter key... Keyboard.c keeps them up to date.
 
 	if (bits <= 8)
 	{
 		int R12 = TMS9995_GetRegister(12);
-		TBYTE value=0x00;
-
-		switch (R12)	
-		{
-		case 0xEC00:
-			if (gKeyboard[SDLK_1])
-				testvalue |= 0x01;
-			if (gKeyboard[SDLK_2])
-				testvalue |= 0x02;
-			if (gKeyboard[SDLK_q])
-				testvalue |= 0x04;
-			if (gKeyboard[SDLK_w])
-				testvalue |= 0x08;
-			if (gKeyboard[SDLK_a])
-				testvalue |= 0x10;
-			if (gKeyboard[SDLK_s])
-				testvalue |= 0x20;
-			if (gKeyboard[SDLK_z])
-				testvalue |= 0x40;
-			if (gKeyboard[SDLK_x])
-				testvalue |= 0x80;
-			break;
-		case 0xEC10:
-			if (gKeyboard[SDLK_3])
-				testvalue |= 0x01;
-			if (gKeyboard[SDLK_4])
-				testvalue |= 0x02;
-			if (gKeyboard[SDLK_e])
-				testvalue |= 0x04;
-			if (gKeyboard[SDLK_r])
-				testvalue |= 0x08;
-			if (gKeyboard[SDLK_d])
-				testvalue |= 0x10;
-			if (gKeyboard[SDLK_f])
-				testvalue |= 0x20;
-			if (gKeyboard[SDLK_c])
-				testvalue |= 0x40;
-			if (gKeyboard[SDLK_v])
-				testvalue |= 0x80;
-			break;
-		case 0xEC20:
-			if (gKeyboard[SDLK_5])
-				testvalue |= 0x01;
-			if (gKeyboard[SDLK_6])
-				testvalue |= 0x02;
-			if (gKeyboard[SDLK_t])
-				testvalue |= 0x04;
-			if (gKeyboard[SDLK_y])
-				testvalue |= 0x08;
-			if (gKeyboard[SDLK_g])
-				testvalue |= 0x10;
-			if (gKeyboard[SDLK_h])
-				testvalue |= 0x20;
-			if (gKeyboard[SDLK_b])
-				testvalue |= 0x40;
-			if (gKeyboard[SDLK_n])
-				testvalue |= 0x80;
-			break;
-		case 0xEC30:
-			if (gKeyboard[SDLK_7])
-				testvalue |= 0x01;
-			if (gKeyboard[SDLK_8])
-				testvalue |= 0x02;
-			if (gKeyboard[SDLK_9])
-				testvalue |= 0x04;
-			if (gKeyboard[SDLK_u])
-				testvalue |= 0x08;
-			if (gKeyboard[SDLK_i])
-				testvalue |= 0x10;
-			if (gKeyboard[SDLK_j])
-				testvalue |= 0x20;
-			if (gKeyboard[SDLK_k])
-				testvalue |= 0x40;
-			if (gKeyboard[SDLK_m])
-				testvalue |= 0x80;
-			break;
-		case 0xEC40:
-			// Joystick/controller 1 also detected here.
-			if (gKeyboard[SDLK_0])
-				testvalue |= 0x01;
-			if (gKeyboard[SDLK_MINUS])
-				testvalue |= 0x02;
-			if (gKeyboard[SDLK_o] || gKeyboard[SDLK_KP0]) // SL
-				testvalue |= 0x04;
-			if (gKeyboard[SDLK_p] || gKeyboard[SDLK_KP_PERIOD]) // SR
-				testvalue |= 0x08;
-			if (gKeyboard[SDLK_l] || gKeyboard[SDLK_KP5]) // down
-				testvalue |= 0x10;
-			if (gKeyboard[SDLK_SEMICOLON] || gKeyboard[SDLK_KP4]) // left
-				testvalue |= 0x20;
-			if (gKeyboard[SDLK_COMMA] || gKeyboard[SDLK_KP8]) // up
-				testvalue |= 0x40;
-			if (gKeyboard[SDLK_PERIOD] || gKeyboard[SDLK_KP6]) // right
-				testvalue |= 0x80;
-			break;
-		case 0xEC50:
-			// Controller 2 also detected here.
-			// 0x01, 0x02 apparently unused
-			if (gKeyboard[SDLK_EQUALS] || gKeyboard[SDLK_KP0]) // handaku // SL
-				testvalue |= 0x04;
-			if (gKeyboard[SDLK_BACKQUOTE] || gKeyboard[SDLK_KP_PERIOD]) // _ // SR
-				testvalue |= 0x08;
-			if (gKeyboard[SDLK_QUOTE] || gKeyboard[SDLK_KP5]) // : // down
-				testvalue |= 0x10;
-			if (gKeyboard[SDLK_LEFTBRACKET] || gKeyboard[SDLK_KP4]) // left
-				testvalue |= 0x20;
-			if (gKeyboard[SDLK_SLASH] || gKeyboard[SDLK_KP8]) // up
-				testvalue |= 0x40;
-			if (gKeyboard[SDLK_RIGHTBRACKET] || gKeyboard[SDLK_KP6]) // right
-				testvalue |= 0x80;
-			break;
-		case 0xEC60:
-			// 0x01 apparently unused
-			if (gKeyboard[CAPS_LOCK_KEY])	// Alpha Lock (sysdep)
-				testvalue |= 0x02;
-			if (gKeyboard[SDLK_LSHIFT] || gKeyboard[SDLK_RSHIFT])
-				testvalue |= 0x04;
-			if (gKeyboard[SDLK_BACKSLASH]) // MON
-				testvalue |= 0x08;
-			if (gKeyboard[SDLK_RETURN])
-				testvalue |= 0x10;
-			// 0x20 apparently unused
-			// MOD
-			// right CTRL may not exist on some laptops ...
-			// for that matter, the iBook doesn't even have RALT
-			if (gKeyboard[SDLK_RCTRL] || gKeyboard[SDLK_RALT]
-					|| gKeyboard[SDLK_KP_ENTER])
-				testvalue |= 0x40;
-			if (gKeyboard[SDLK_SPACE])
-				testvalue |= 0x80;
-			break;
-		case 0xEC70:
-			// 0xF0 apparently unused
-			if (gKeyboard[SDLK_LEFT] || gKeyboard[SDLK_BACKSPACE])
-				testvalue |= 0x01;
-			if (gKeyboard[SDLK_UP])
-				testvalue |= 0x02;
-			if (gKeyboard[SDLK_DOWN])
-				testvalue |= 0x04;
-			if (gKeyboard[SDLK_RIGHT])
-				testvalue |= 0x08;
-			break;
-		default:
-			{
-			int a=1;
+
+		if (LIKELY((R12 & 0xFF8F) == 0xEC00))
+			testvalue = gKeyMatrix[(R12 >> 4) & 7];
+		else
 			testvalue = (2 << (bits-1))-1;
-			}
-			break;
-		}
 	}
 	else
 	{
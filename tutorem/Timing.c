@@ -0,0 +1,184 @@
+/* Timing.c
+	Slice pacing against absolute deadlines on a monotonic clock.
+
+   Each slice of emulation has a deadline, exactly its share of emulated
+   time after the one before; the remainder is carried, so the
+   emulation runs at precisely the target speed. Because the wait is for
+   an absolute time rather than for however long is left, oversleeping
+   one slice just makes the next wait shorter instead of adding up, and
+   since the clock is monotonic, setting the wall clock can't stall it.
+
+   If the emulation falls behind, slices run without waiting until it
+   catches up; if it falls too far behind (a stall, the debugger, warp
+   speed) the lost time is given up on and the schedule starts again
+   from now. Optionally, the last part of each wait is spent spinning on
+   the clock, which is kinder to jitter than to the battery. */
+
+#ifdef _WIN32
+#include <windows.h>
+#elif __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#include <errno.h>
+#endif
+
+#include "SDL/SDL.h"
+
+#include "Timing.h"
+
+#define NANOS	1000000000
+
+// A slice is sliceNanos plus sliceRemainder/clockRate nanoseconds.
+static Uint64 sliceNanos = 1666666;
+static Uint32 sliceRemainder = 2, clockRate = 3;
+static Uint64 deadline = 0;
+static Uint32 remainder = 0;
+static Uint64 spin = 0, maxLag = 100000000;
+// Running average in 1/16 microseconds.
+static long jitterAverage = 0, worst = 0;
+static unsigned long behind = 0, skipped = 0;
+
+#ifdef _WIN32
+static HANDLE timer = NULL;
+static LARGE_INTEGER frequency;
+#elif __APPLE__
+static mach_timebase_info_data_t timebase;
+#endif
+
+/* Nanoseconds on the monotonic clock, from whenever it started. */
+Uint64 Timing_Now()
+{
+#ifdef _WIN32
+	LARGE_INTEGER count;
+
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&count);
+	return (Uint64)(count.QuadPart / frequency.QuadPart) * NANOS +
+		(Uint64)(count.QuadPart % frequency.QuadPart) * NANOS /
+		frequency.QuadPart;
+#elif __APPLE__
+	Uint64 t = mach_absolute_time();
+
+	if (!timebase.denom)
+		mach_timebase_info(&timebase);
+	return t / timebase.denom * timebase.numer +
+		t % timebase.denom * timebase.numer / timebase.denom;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (Uint64)now.tv_sec * NANOS + now.tv_nsec;
+#endif
+}
+
+static void Timing_SleepUntil(Uint64 when)
+{
+#ifdef _WIN32
+	// Waitable timers only take absolute times on the wall clock, so
+	// aim at the deadline from here. It's still the same deadline
+	// next time, so an overshoot doesn't accumulate.
+	LARGE_INTEGER due;
+	Uint64 now = Timing_Now();
+
+	if (when <= now + 100) return;
+	due.QuadPart = -(LONGLONG)((when - now) / 100);
+	SetWaitableTimer(timer, &due, 0, NULL, NULL, 0);
+	WaitForSingleObject(timer, INFINITE);
+#elif __APPLE__
+	mach_wait_until(when / timebase.numer * timebase.denom +
+		when % timebase.numer * timebase.denom / timebase.numer);
+#else
+	struct timespec at;
+
+	at.tv_sec = when / NANOS;
+	at.tv_nsec = when % NANOS;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL)
+			== EINTR);
+#endif
+}
+
+/* Slices are cycles of a clock-Hz CPU. Spin for the last spinMicros of
+   each wait, if that isn't zero, and give up on lost time beyond
+   maxLagMicros. */
+void Timing_Init(Uint32 cycles, Uint32 clock, long spinMicros,
+	long maxLagMicros)
+{
+#ifdef _WIN32
+	if (!timer)
+		timer = CreateWaitableTimer(NULL, TRUE, NULL);
+#endif
+	sliceNanos = (Uint64)cycles * NANOS / clock;
+	sliceRemainder = (Uint64)cycles * NANOS % clock;
+	clockRate = clock;
+	spin = (spinMicros > 0) ? (Uint64)spinMicros * 1000 : 0;
+	maxLag = (Uint64)maxLagMicros * 1000;
+	deadline = Timing_Now();
+	remainder = 0;
+	jitterAverage = worst = 0;
+	behind = skipped = 0;
+}
+
+void Timing_Stop()
+{
+#ifdef _WIN32
+	if (timer)
+		CloseHandle(timer);
+	timer = NULL;
+#endif
+}
+
+/* Wait until the current slice's time is up. */
+void Timing_Wait()
+{
+	Uint64 now;
+	long late;
+
+	deadline += sliceNanos;
+	remainder += sliceRemainder;
+	if (remainder >= clockRate) {
+		remainder -= clockRate;
+		deadline++;
+	}
+
+	now = Timing_Now();
+	if (now >= deadline) {
+		if (now - deadline > maxLag) {
+			deadline = now;
+			skipped++;
+		} else
+			behind++;
+		return;
+	}
+	if (deadline - now > spin)
+		Timing_SleepUntil(deadline - spin);
+	if (spin)
+		while ((now = Timing_Now()) < deadline);
+	else
+		now = Timing_Now();
+
+	late = (now > deadline) ? (long)((now - deadline) / 1000) : 0;
+	jitterAverage += late - (jitterAverage >> 4);
+	if (late > worst)
+		worst = late;
+}
+
+/* Sleep for micros instead, for when something else sets the pace, and
+   take up the schedule again from when it wakes. */
+void Timing_Sleep(long micros)
+{
+	if (micros > 0)
+		Timing_SleepUntil(Timing_Now() + (Uint64)micros * 1000);
+	deadline = Timing_Now();
+	remainder = 0;
+}
+
+void Timing_GetStats(TimingStats *stats)
+{
+	stats->jitter = jitterAverage >> 4;
+	stats->worst = worst;
+	stats->behind = behind;
+	stats->skipped = skipped;
+	worst = 0;
+}
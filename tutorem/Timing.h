@@ -0,0 +1,18 @@
+/* Timing.h
+	Slice pacing against absolute deadlines on a monotonic clock. */
+
+typedef struct TimingStatsStruct
+{
+	int jitter;		// average lateness waking up, microseconds
+	int worst;		// worst lateness since the last reading
+	unsigned long behind;	// slices started late, to catch up
+	unsigned long skipped;	// times the lost time was given up on
+} TimingStats;
+
+void Timing_Init(Uint32 cycles, Uint32 clock, long spinMicros,
+	long maxLagMicros);
+void Timing_Stop();
+Uint64 Timing_Now();
+void Timing_Wait();
+void Timing_Sleep(long micros);
+void Timing_GetStats(TimingStats *stats);